@@ -0,0 +1,180 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_ADAPTIVE_JI_H
+#define TUNING_NOTE_CLAPS_ADAPTIVE_JI_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * AdaptiveJI tunes each held key to a just interval above a reference key, which is the
+ * oldest key still held. A new note only has to work out its own interval, so held notes
+ * never move under a note on. When the reference is released, the lowest remaining key
+ * takes over at its current pitch and the rest of the chord is retuned against it.
+ *
+ * Handing the reference along like that lets the pitch drift away from the anchor over a
+ * progression. driftControl pulls each new reference back toward the anchor by that
+ * fraction, so 0 drifts freely and 1 keeps every reference on the anchored 12-TET grid.
+ *
+ * Everything is fixed size and per key, so work per note on or off is bounded by the
+ * number of held keys.
+ */
+struct AdaptiveJI
+{
+    enum IntervalSet
+    {
+        five_limit = 0,
+        seven_limit
+    };
+
+    double driftControl{0.5};
+    double anchor{0.0}; // the whole grid's offset from 12-TET, in semitones
+    IntervalSet intervalSet{five_limit};
+
+    std::array<double, 128> retune;        // semitones from 12-TET; kept for released keys
+    std::array<uint8_t, 128> heldCount;    // a key can be held on several channels or ports
+    std::array<int16_t, 128> held, heldAt; // compact list of held keys and where each sits
+    int heldSize{0};
+    int referenceKey{-1};
+
+    uint64_t generation{0}; // moves whenever a held key's retuning moves
+
+    AdaptiveJI()
+    {
+        retune.fill(0.0);
+        heldCount.fill(0);
+        heldAt.fill(-1);
+        setIntervalSet(five_limit);
+    }
+
+    void setIntervalSet(IntervalSet s)
+    {
+        intervalSet = s;
+
+        // Just ratios for each interval class above the reference
+        static constexpr int five[12][2] = {{1, 1},   {16, 15}, {9, 8},  {6, 5},
+                                            {5, 4},   {4, 3},   {45, 32}, {3, 2},
+                                            {8, 5},   {5, 3},   {16, 9}, {15, 8}};
+        for (int i = 0; i < 12; ++i)
+        {
+            auto n = five[i][0], d = five[i][1];
+            if (s == seven_limit && i == 6)
+            {
+                n = 7;
+                d = 5;
+            }
+            if (s == seven_limit && i == 10)
+            {
+                n = 7;
+                d = 4;
+            }
+            offsets[i] = 12.0 * std::log2((double)n / d) - i;
+        }
+
+        if (heldSize > 0)
+            retuneHeld();
+    }
+
+    void setAnchor(double a)
+    {
+        // Moving the anchor under held notes would bend them, so wait for the hands to come off
+        if (heldSize == 0)
+        {
+            anchor = a;
+        }
+        else
+        {
+            pendingAnchor = a;
+            hasPendingAnchor = true;
+        }
+    }
+
+    void noteOn(int key)
+    {
+        if (heldCount[key]++ > 0)
+            return;
+
+        heldAt[key] = (int16_t)heldSize;
+        held[heldSize++] = (int16_t)key;
+
+        if (referenceKey < 0)
+        {
+            referenceKey = key;
+            retune[key] = anchor;
+        }
+        else
+        {
+            retune[key] = intervalFrom(referenceKey, key);
+        }
+    }
+
+    void noteOff(int key)
+    {
+        if (heldCount[key] == 0 || --heldCount[key] > 0)
+            return;
+
+        auto pos = heldAt[key];
+        held[pos] = held[--heldSize];
+        heldAt[held[pos]] = pos;
+        heldAt[key] = -1;
+
+        if (heldSize == 0)
+        {
+            referenceKey = -1;
+            if (hasPendingAnchor)
+            {
+                anchor = pendingAnchor;
+                hasPendingAnchor = false;
+            }
+            return;
+        }
+
+        if (key != referenceKey)
+            return;
+
+        referenceKey = held[0];
+        for (int i = 1; i < heldSize; ++i)
+            if (held[i] < referenceKey)
+                referenceKey = held[i];
+
+        auto &r = retune[referenceKey];
+        r += driftControl * (anchor - r);
+        retuneHeld();
+    }
+
+  private:
+    std::array<double, 12> offsets;
+    double pendingAnchor{0};
+    bool hasPendingAnchor{false};
+
+    double intervalFrom(int ref, int key) const
+    {
+        auto ic = ((key - ref) % 12 + 12) % 12;
+        return retune[ref] + offsets[ic];
+    }
+
+    void retuneHeld()
+    {
+        for (int i = 0; i < heldSize; ++i)
+        {
+            auto k = held[i];
+            if (k != referenceKey)
+                retune[k] = intervalFrom(referenceKey, k);
+        }
+        generation++;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_ADAPTIVE_JI_H
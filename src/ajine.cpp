@@ -0,0 +1,381 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#include <algorithm>
+
+#include "clap_creators.h"
+
+#include <clap/clap.h>
+#include <clap/events.h>
+#include <clap/helpers/plugin.hh>
+#include <clap/helpers/plugin.hxx>
+#include <clap/helpers/host-proxy.hh>
+#include <clap/helpers/host-proxy.hxx>
+
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <cmath>
+
+#include "helpers.h"
+#include "adaptive_ji.h"
+
+struct AJINE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
+                                            clap::helpers::CheckingLevel::Minimal>
+{
+    AJINE(const clap_plugin_descriptor_t *desc, const clap_host *host)
+        : clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
+                                clap::helpers::CheckingLevel::Minimal>(desc, host)
+    {
+        sizeNoteStateCore(this);
+        publishParams(this, nullptr, 0);
+    }
+
+    double sampleRate{0};
+    double postNoteRelease{2.0};
+    double anchorFrequency{440};
+
+    bool activate(double sampleRate, uint32_t minFrameCount,
+                  uint32_t maxFrameCount) noexcept override
+    {
+        this->sampleRate = sampleRate;
+        TNC_CAPTURE_ACTIVATE(capture, clapPlugin(), sampleRate, minFrameCount, maxFrameCount);
+        return true;
+    }
+
+    enum ParamID
+    {
+        release = 0,
+        drift_control,
+        anchor_frequency,
+        interval_set,
+        note_ports
+    };
+    static constexpr int paramCount = note_ports + 1;
+
+    bool implementsNotePorts() const noexcept override { return true; }
+    uint32_t notePortsCount(bool isInput) const noexcept override { return notePorts; }
+    bool notePortsInfo(uint32_t index, bool isInput,
+                       clap_note_port_info *info) const noexcept override
+    {
+        return notePortsInfoCore(index, isInput, "AJI", info);
+    }
+
+    uint32_t notePorts{1};
+    std::atomic<uint32_t> requestedNotePorts{1};
+
+    void deactivate() noexcept override
+    {
+        TNC_CAPTURE_DEACTIVATE(capture);
+        if (requestedNotePorts != notePorts)
+            _host.requestCallback();
+    }
+
+    void onMainThread() noexcept override { updateNotePortsCore(this, _host, isActive()); }
+
+    static constexpr int paramIdBase = 93417;
+    bool implementsParams() const noexcept override { return true; }
+    bool isValidParamId(clap_id paramId) const noexcept override
+    {
+        return paramId >= paramIdBase && paramId < paramIdBase + paramsCount();
+    }
+    uint32_t paramsCount() const noexcept override { return paramCount; }
+    bool paramsInfo(uint32_t paramIndex, clap_param_info *info) const noexcept override
+    {
+        info->id = paramIndex + paramIdBase;
+
+        switch (paramIndex)
+        {
+        case release:
+            strncpy(info->name, "Post Note Release (s)", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 16;
+            info->default_value = 2;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case drift_control:
+            strncpy(info->name, "Drift Control", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0.5;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case anchor_frequency:
+            strncpy(info->name, "Anchor A Frequency", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 415;
+            info->max_value = 466;
+            info->default_value = 440;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case interval_set:
+            strncpy(info->name, "Interval Set", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case note_ports:
+            strncpy(info->name, "Note Ports", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 1;
+            info->max_value = maxNotePorts;
+            info->default_value = 1;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        default:
+            return false;
+        }
+
+        return true;
+    }
+    bool paramsValue(clap_id paramId, double *value) noexcept override
+    {
+        if (!isValidParamId(paramId))
+            return false;
+        *value = params.values()[paramId - paramIdBase];
+        return true;
+    }
+
+    // The audio thread's view, which publishParams copies into the snapshot
+    double liveParamValue(clap_id paramId) const
+    {
+        switch (paramId)
+        {
+        case paramIdBase + release:
+            return postNoteRelease;
+        case paramIdBase + drift_control:
+            return ji.driftControl;
+        case paramIdBase + anchor_frequency:
+            return anchorFrequency;
+        case paramIdBase + interval_set:
+            return ji.intervalSet;
+        case paramIdBase + note_ports:
+            return requestedNotePorts;
+        }
+        return 0;
+    }
+
+    bool paramsValueToText(clap_id paramId, double value, char *display,
+                           uint32_t size) noexcept override
+    {
+        memset(display, 0, size * sizeof(char));
+        switch (paramId)
+        {
+        case paramIdBase + note_ports:
+        {
+            strncpy(display, std::to_string((int)value).c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + release:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(4) << value << " s";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + drift_control:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(3) << value * 100.0 << " %";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + anchor_frequency:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(8) << value << " Hz";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + interval_set:
+        {
+            if (value > 0.5)
+                strncpy(display, "7-Limit", size - 1);
+            else
+                strncpy(display, "5-Limit", size - 1);
+            return true;
+        }
+        }
+        return false;
+    }
+
+    bool paramsTextToValue(clap_id paramId, const char *display, double *value) noexcept override
+    {
+        switch (paramId)
+        {
+        case paramIdBase + note_ports:
+        {
+            *value = std::atoi(display);
+            return true;
+        }
+        case paramIdBase + drift_control:
+        {
+            *value = std::atof(display) / 100.0;
+            return true;
+        }
+        case paramIdBase + interval_set:
+        {
+            *value = (display[0] == '7') ? 1 : 0;
+            return true;
+        }
+        case paramIdBase + release:
+        case paramIdBase + anchor_frequency:
+        {
+            *value = std::atof(display);
+            return true;
+        }
+        }
+        return false;
+    }
+
+    TNC_TRACE_INSTANCE(trace, "AJINE");
+    TNC_CAPTURE_INSTANCE(capture);
+    NoteArray<uint8_t> noteState;
+    ReleaseWheel releases; // deadlines of releasing notes, in samples
+    uint64_t sampleClock{0};
+    NoteArray<double> sclTuning;
+    NoteArray<double> expressionTuning; // the last inbound tuning expression per note
+    uint64_t retunedGeneration{0};
+    ScaleSnap snap; // there is no fixed scale to snap to, so this stays off
+
+    AdaptiveJI ji;
+    uint64_t announcedGeneration{0};
+    ParamSnapshot<paramCount> params;
+
+    bool implementsState() const noexcept override { return true; }
+    bool stateSave(const clap_ostream *stream) noexcept override
+    {
+        std::map<clap_id, double> vals;
+        const auto &v = params.values();
+        for (int i = 0; i < paramCount; ++i)
+            vals[paramIdBase + i] = v[i];
+        return helpersStateSave(stream, vals);
+    }
+    bool stateLoad(const clap_istream *stream) noexcept override
+    {
+        TNC_TRACE_SCOPE(trace.main, "stateLoad");
+        std::map<clap_id, double> vals;
+        auto res = helpersStateLoad(stream, vals);
+        if (!res)
+            return false;
+
+        // The audio thread applies the values at its next block; with none running we do
+        fillParamDefaults(this, vals);
+        params.post(vals, paramIdBase);
+        if (!isActive())
+        {
+            applyLoadedParams(this);
+            publishParams(this, nullptr, 0);
+            updateNotePortsCore(this, _host, isActive());
+        }
+
+        TNC_CAPTURE_STATE(capture, clapPlugin());
+        return true;
+    }
+
+    bool tuningActive() { return true; }
+    uint64_t tuningGeneration() { return ji.generation; }
+    int tuningChannel(int port, int channel) { return channel; }
+    double retuningFor(int key, int channel) { return ji.retune[key]; }
+
+    // The engine sees each key once however many ports and channels hold it
+    void heldNoteOn(int key) { ji.noteOn(key); }
+    void heldNoteOff(int key) { ji.noteOff(key); }
+    bool noteFiltered(int port, int channel, int key) const { return false; }
+
+    // Only held keys move when the reference passes on; released ones keep their pitch
+    const int16_t *retunedKeys(int &count)
+    {
+        count = ji.heldSize;
+        return ji.held.data();
+    }
+    void handleMidi(const clap_event_midi *mevt) {}
+
+    // A release which hands the reference on retunes the rest of the chord right there
+    bool nextTuningChange(uint32_t upTo, uint32_t &at)
+    {
+        if (ji.generation == announcedGeneration)
+            return false;
+
+        announcedGeneration = ji.generation;
+        at = upTo;
+        return true;
+    }
+
+    clap_process_status process(const clap_process *process) noexcept override
+    {
+        TNC_REALTIME_SCOPE();
+        TNC_TRACE_SCOPE(trace.process, "process");
+        processTuningCore(this, process);
+        return CLAP_PROCESS_CONTINUE;
+    }
+
+    void handleParamValue(const clap_event_param_value *pevt)
+    {
+        auto id = pevt->param_id;
+        auto nf = pevt->value;
+
+        switch (id)
+        {
+        case paramIdBase + release:
+        {
+            postNoteRelease = std::clamp(nf, 0., 100.);
+        }
+        break;
+        case paramIdBase + drift_control:
+        {
+            ji.driftControl = std::clamp(nf, 0., 1.);
+        }
+        break;
+        case paramIdBase + anchor_frequency:
+        {
+            anchorFrequency = std::clamp(nf, 415.0, 466.0);
+            ji.setAnchor(12.0 * std::log2(anchorFrequency / 440.0));
+        }
+        break;
+        case paramIdBase + interval_set:
+        {
+            ji.setIntervalSet(nf > 0.5 ? AdaptiveJI::seven_limit : AdaptiveJI::five_limit);
+        }
+        break;
+        case paramIdBase + note_ports:
+        {
+            requestedNotePorts = std::clamp(static_cast<int>(std::round(nf)), 1, maxNotePorts);
+            _host.requestCallback();
+        }
+        break;
+        }
+    }
+
+    void paramsFlush(const clap_input_events *in, const clap_output_events *out) noexcept override
+    {
+        TNC_REALTIME_SCOPE();
+        paramsFlushTuningCore(this, in, out);
+    }
+
+    bool retuneHeldNotes() { return true; }
+};
+const clap_plugin *create_ajine(const clap_plugin_descriptor_t *desc, const clap_host *host)
+{
+    auto *plug = new AJINE(desc, host);
+    return plug->clapPlugin();
+}
@@ -0,0 +1,592 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_CAPTURE_H
+#define TUNING_NOTE_CLAPS_CAPTURE_H
+
+/*
+ * Session capture, so a problem heard in a DAW can be replayed without one. Configure with
+ * -DTUNING_NOTE_CLAPS_CAPTURE=ON and run the host with TUNING_NOTE_CLAPS_CAPTURE_DIR set to
+ * a directory; every instance then writes a .tnccap file there from its first activation,
+ * which the replay-trace tool plays back.
+ *
+ * A capture holds the state chunk at each activation and at each state load made while
+ * active, and for every process() and paramsFlush() call the frame count, transport, input
+ * events and the events the plugin pushed, which replay treats as the golden output.
+ *
+ * The processing thread copies each block into a single producer byte ring. It never blocks
+ * or allocates; a block which doesn't fit is dropped and the next one says how many went
+ * missing. Main thread records are queued under a lock and carry the block count at the time,
+ * so the background thread which drains everything to disk can put them in block order.
+ *
+ * The file format is always compiled so the tool can read it. Without the build option the
+ * capture macros are empty.
+ */
+
+#include <clap/events.h>
+
+#include <cstdint>
+
+namespace capture
+{
+static constexpr char magic[8] = {'T', 'N', 'C', 'C', 'A', 'P', 'T', 'R'};
+static constexpr uint32_t version = 1;
+
+// Everything is in the byte order of the machine which captured it and 8 byte aligned
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+enum RecordType : uint32_t
+{
+    rec_plugin = 1, // the plugin id, null terminated
+    rec_activate,   // ActivateRecord, then the state chunk
+    rec_deactivate, // nothing
+    rec_state,      // a state load while active: uint64_t size, then the chunk saved after it
+    rec_process,    // BlockRecord, then the input events, then the output events
+    rec_flush       // as rec_process, with frames and transport unused
+};
+
+struct RecordHeader
+{
+    uint32_t type;
+    uint32_t size;  // of what follows, a multiple of 8
+    uint64_t block; // process and flush calls made before this record
+};
+
+struct ActivateRecord
+{
+    double sampleRate;
+    uint32_t minFrames, maxFrames;
+    uint64_t stateSize;
+};
+
+enum BlockFlags : uint32_t
+{
+    has_transport = 1,
+    load_applied = 2,    // the block applied a state load posted by the main thread
+    output_truncated = 4 // the plugin pushed more than we could keep
+};
+
+struct BlockRecord
+{
+    uint32_t frames;
+    uint32_t flags;
+    uint32_t inCount, outCount;
+    uint32_t droppedBefore; // blocks lost to a full ring just before this one
+    uint32_t skippedInputs; // events we can't store, such as SysEx, which points elsewhere
+    int64_t steadyTime;
+    clap_event_transport transport;
+};
+
+// Events are stored as their header->size bytes, padded to a multiple of 8
+static constexpr uint32_t maxEventSize = 256;
+inline uint32_t padded(uint32_t n) { return (n + 7) & ~7u; }
+
+inline bool storable(const clap_event_header *e)
+{
+    return e->size >= sizeof(clap_event_header) && e->size <= maxEventSize &&
+           !(e->space_id == CLAP_CORE_EVENT_SPACE_ID && e->type == CLAP_EVENT_MIDI_SYSEX);
+}
+} // namespace capture
+
+#if TUNING_NOTE_CLAPS_CAPTURE
+
+#include <clap/plugin.h>
+#include <clap/ext/state.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <process.h>
+#define TNC_CAPTURE_GETPID _getpid
+#else
+#include <unistd.h>
+#define TNC_CAPTURE_GETPID getpid
+#endif
+
+struct CaptureStream
+{
+    static constexpr uint64_t capacity = 1 << 22; // a power of two
+    static constexpr uint64_t mask = capacity - 1;
+
+    std::unique_ptr<uint8_t[]> ring{new uint8_t[capacity]};
+    alignas(64) std::atomic<uint64_t> head{0};   // written by the processing thread
+    alignas(64) std::atomic<uint64_t> tail{0};   // written by the drain thread
+    alignas(64) std::atomic<uint64_t> blocks{0}; // written by the processing thread
+
+    // Owned by the processing thread
+    uint64_t writePos{0};
+    uint32_t dropped{0};
+    std::array<uint8_t, 1 << 16> outputs;
+    uint32_t outputBytes{0}, outputCount{0};
+    bool outputTruncated{false};
+
+    // Guarded by the session lock
+    std::vector<std::vector<uint8_t>> pending;
+    FILE *file{nullptr};
+    uint64_t nextBlock{0};
+
+    void put(const void *data, uint64_t size)
+    {
+        auto src = static_cast<const uint8_t *>(data);
+        while (size > 0)
+        {
+            auto at = writePos & mask;
+            auto n = std::min(size, capacity - at);
+            memcpy(ring.get() + at, src, n);
+            writePos += n;
+            src += n;
+            size -= n;
+        }
+    }
+
+    void putEvent(const clap_event_header *e)
+    {
+        static constexpr uint8_t zeros[8]{};
+        put(e, e->size);
+        put(zeros, capture::padded(e->size) - e->size);
+    }
+
+    void keepOutput(const clap_event_header *e)
+    {
+        if (!capture::storable(e) || outputBytes + capture::padded(e->size) > outputs.size())
+        {
+            outputTruncated = true;
+            return;
+        }
+        memset(outputs.data() + outputBytes, 0, capture::padded(e->size));
+        memcpy(outputs.data() + outputBytes, e, e->size);
+        outputBytes += capture::padded(e->size);
+        outputCount++;
+    }
+
+    void writeBlock(uint32_t type, uint32_t frames, int64_t steadyTime,
+                    const clap_event_transport *transport, const clap_input_events *in,
+                    uint32_t flags)
+    {
+        using namespace capture;
+        auto index = blocks.load(std::memory_order_relaxed);
+
+        BlockRecord b;
+        memset(&b, 0, sizeof(b));
+        b.frames = frames;
+        b.steadyTime = steadyTime;
+        b.flags = flags | (outputTruncated ? (uint32_t)output_truncated : 0u);
+        if (transport)
+        {
+            b.flags |= has_transport;
+            b.transport = *transport;
+        }
+
+        uint64_t inputBytes = 0;
+        auto n = in ? in->size(in) : 0;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            auto e = in->get(in, i);
+            if (storable(e))
+            {
+                inputBytes += padded(e->size);
+                b.inCount++;
+            }
+            else
+            {
+                b.skippedInputs++;
+            }
+        }
+        b.outCount = outputCount;
+
+        RecordHeader h;
+        h.type = type;
+        h.size = (uint32_t)(sizeof(BlockRecord) + inputBytes + outputBytes);
+        h.block = index;
+
+        writePos = head.load(std::memory_order_relaxed);
+        if (capacity - (writePos - tail.load(std::memory_order_acquire)) <
+            sizeof(RecordHeader) + h.size)
+        {
+            dropped++;
+        }
+        else
+        {
+            b.droppedBefore = dropped;
+            dropped = 0;
+            put(&h, sizeof(h));
+            put(&b, sizeof(b));
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                auto e = in->get(in, i);
+                if (storable(e))
+                    putEvent(e);
+            }
+            put(outputs.data(), outputBytes);
+            head.store(writePos, std::memory_order_release);
+        }
+
+        blocks.store(index + 1, std::memory_order_release);
+        outputBytes = 0;
+        outputCount = 0;
+        outputTruncated = false;
+    }
+
+    // Drain side; copies the bytes at ring position from, across the wrap if need be
+    void get(uint64_t from, void *data, uint64_t size) const
+    {
+        auto dst = static_cast<uint8_t *>(data);
+        while (size > 0)
+        {
+            auto at = from & mask;
+            auto n = std::min(size, capacity - at);
+            memcpy(dst, ring.get() + at, n);
+            from += n;
+            dst += n;
+            size -= n;
+        }
+    }
+};
+
+struct CaptureSession
+{
+    static CaptureSession &get()
+    {
+        static CaptureSession s;
+        return s;
+    }
+
+    bool enabled() const { return !directory.empty(); }
+
+    // Streams are added and removed from the main thread, as instances activate and go away
+    void add(CaptureStream *s, const char *pluginId)
+    {
+        std::unique_lock<std::mutex> g(lock);
+        static int instances{0};
+        auto path = directory + "/" + pluginId + "-" + std::to_string((int)TNC_CAPTURE_GETPID()) +
+                    "-" + std::to_string(++instances) + ".tnccap";
+        s->file = fopen(path.c_str(), "wb");
+        if (s->file)
+        {
+            capture::FileHeader fh;
+            memcpy(fh.magic, capture::magic, sizeof(fh.magic));
+            fh.version = capture::version;
+            fh.reserved = 0;
+            fwrite(&fh, sizeof(fh), 1, s->file);
+        }
+        streams.push_back(s);
+        if (!drainer.joinable())
+        {
+            stopping = false;
+            drainer = std::thread([this]() { run(); });
+        }
+    }
+
+    void queue(CaptureStream *s, std::vector<uint8_t> &&record)
+    {
+        {
+            std::unique_lock<std::mutex> g(lock);
+            s->pending.push_back(std::move(record));
+        }
+        wake.notify_all();
+    }
+
+    void remove(CaptureStream *s)
+    {
+        std::unique_lock<std::mutex> g(lock);
+        write(s, true);
+        if (s->file)
+            fclose(s->file);
+        s->file = nullptr;
+        for (auto it = streams.begin(); it != streams.end(); ++it)
+        {
+            if (*it == s)
+            {
+                streams.erase(it);
+                break;
+            }
+        }
+        if (!streams.empty() || !drainer.joinable())
+            return;
+
+        stopping = true;
+        g.unlock();
+        wake.notify_all();
+        drainer.join();
+    }
+
+  private:
+    CaptureSession()
+    {
+        auto dir = std::getenv("TUNING_NOTE_CLAPS_CAPTURE_DIR");
+        if (dir && *dir)
+            directory = dir;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> g(lock);
+        while (!stopping)
+        {
+            wake.wait_for(g, std::chrono::milliseconds(50));
+            for (auto *s : streams)
+                write(s, false);
+        }
+    }
+
+    // Main thread records go in front of the first block they came before
+    void writePending(CaptureStream *s, uint64_t upTo, bool all)
+    {
+        size_t done = 0;
+        for (; done < s->pending.size(); ++done)
+        {
+            const auto &r = s->pending[done];
+            if (!all && reinterpret_cast<const capture::RecordHeader *>(r.data())->block > upTo)
+                break;
+            if (s->file)
+                fwrite(r.data(), 1, r.size(), s->file);
+        }
+        s->pending.erase(s->pending.begin(), s->pending.begin() + done);
+    }
+
+    void write(CaptureStream *s, bool all)
+    {
+        // Every block counted here is either in the ring up to head or was dropped
+        auto counted = s->blocks.load(std::memory_order_acquire);
+        auto t = s->tail.load(std::memory_order_relaxed);
+        auto h = s->head.load(std::memory_order_acquire);
+
+        char chunk[4096];
+        while (t != h)
+        {
+            capture::RecordHeader rh;
+            s->get(t, &rh, sizeof(rh));
+            writePending(s, rh.block, false);
+
+            auto size = sizeof(rh) + (uint64_t)rh.size;
+            for (uint64_t at = 0; at < size; at += sizeof(chunk))
+            {
+                auto n = std::min<uint64_t>(sizeof(chunk), size - at);
+                s->get(t + at, chunk, n);
+                if (s->file)
+                    fwrite(chunk, 1, n, s->file);
+            }
+            t += size;
+            s->nextBlock = rh.block + 1;
+        }
+        s->tail.store(t, std::memory_order_release);
+
+        writePending(s, std::max(s->nextBlock, counted), all);
+        if (s->file)
+            fflush(s->file);
+    }
+
+    std::string directory;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread drainer;
+    std::vector<CaptureStream *> streams;
+    bool stopping{false};
+};
+
+struct CaptureInstance
+{
+    std::unique_ptr<CaptureStream> stream;
+    bool active{false};
+
+    ~CaptureInstance()
+    {
+        if (stream)
+            CaptureSession::get().remove(stream.get());
+    }
+
+    void activate(const clap_plugin *plugin, double sampleRate, uint32_t minFrames,
+                  uint32_t maxFrames)
+    {
+        auto &s = CaptureSession::get();
+        if (!s.enabled())
+            return;
+        if (!stream)
+        {
+            stream = std::make_unique<CaptureStream>();
+            s.add(stream.get(), plugin->desc->id);
+            queue(capture::rec_plugin, plugin->desc->id, strlen(plugin->desc->id) + 1);
+        }
+
+        std::vector<uint8_t> state;
+        saveState(plugin, state);
+        capture::ActivateRecord a;
+        a.sampleRate = sampleRate;
+        a.minFrames = minFrames;
+        a.maxFrames = maxFrames;
+        a.stateSize = state.size();
+        queue(capture::rec_activate, &a, sizeof(a), state.data(), state.size());
+        active = true;
+    }
+
+    void deactivate()
+    {
+        if (!stream || !active)
+            return;
+        queue(capture::rec_deactivate);
+        active = false;
+    }
+
+    // Loads while inactive are covered by the state at the next activation
+    void stateLoaded(const clap_plugin *plugin)
+    {
+        if (!stream || !active)
+            return;
+        std::vector<uint8_t> state;
+        saveState(plugin, state);
+        uint64_t size = state.size();
+        queue(capture::rec_state, &size, sizeof(size), state.data(), state.size());
+    }
+
+  private:
+    static void saveState(const clap_plugin *plugin, std::vector<uint8_t> &into)
+    {
+        auto st = static_cast<const clap_plugin_state *>(
+            plugin->get_extension(plugin, CLAP_EXT_STATE));
+        if (!st)
+            return;
+
+        clap_ostream os;
+        os.ctx = &into;
+        os.write = [](const clap_ostream *s, const void *buffer, uint64_t size) -> int64_t {
+            auto v = static_cast<std::vector<uint8_t> *>(s->ctx);
+            auto b = static_cast<const uint8_t *>(buffer);
+            v->insert(v->end(), b, b + size);
+            return (int64_t)size;
+        };
+        if (!st->save(plugin, &os))
+            into.clear();
+    }
+
+    void queue(uint32_t type, const void *a = nullptr, size_t aSize = 0,
+               const void *b = nullptr, size_t bSize = 0)
+    {
+        capture::RecordHeader h;
+        h.type = type;
+        h.size = capture::padded((uint32_t)(aSize + bSize));
+        h.block = stream->blocks.load(std::memory_order_acquire);
+
+        std::vector<uint8_t> r(sizeof(h) + h.size, 0);
+        memcpy(r.data(), &h, sizeof(h));
+        if (aSize)
+            memcpy(r.data() + sizeof(h), a, aSize);
+        if (bSize)
+            memcpy(r.data() + sizeof(h) + aSize, b, bSize);
+        CaptureSession::get().queue(stream.get(), std::move(r));
+    }
+};
+
+/*
+ * Lives for one process() or paramsFlush() call. It points the call's output events at a
+ * proxy which keeps a copy of everything the plugin pushes, and writes the block on the way
+ * out.
+ */
+struct CaptureBlock
+{
+    CaptureStream *stream;
+    const clap_output_events *target{nullptr};
+    clap_output_events proxy;
+    clap_process wrapped;
+    uint32_t flags{0};
+
+    uint32_t type, frames{0};
+    int64_t steadyTime{-1};
+    const clap_event_transport *transport{nullptr};
+    const clap_input_events *in{nullptr};
+
+    CaptureBlock(CaptureInstance &c, const clap_process *&process)
+        : stream(c.stream.get()), type(capture::rec_process)
+    {
+        if (!stream)
+            return;
+        wrapped = *process;
+        frames = process->frames_count;
+        steadyTime = process->steady_time;
+        transport = process->transport;
+        in = process->in_events;
+        wrap(process->out_events);
+        wrapped.out_events = &proxy;
+        process = &wrapped;
+    }
+
+    CaptureBlock(CaptureInstance &c, const clap_input_events *in,
+                 const clap_output_events *&out)
+        : stream(c.stream.get()), type(capture::rec_flush), in(in)
+    {
+        if (!stream)
+            return;
+        wrap(out);
+        out = &proxy;
+    }
+
+    ~CaptureBlock()
+    {
+        if (stream)
+            stream->writeBlock(type, frames, steadyTime, transport, in, flags);
+    }
+
+  private:
+    void wrap(const clap_output_events *out)
+    {
+        target = out;
+        proxy.ctx = this;
+        proxy.try_push = [](const clap_output_events *l, const clap_event_header *e) {
+            auto self = static_cast<CaptureBlock *>(l->ctx);
+            if (!self->target || !self->target->try_push(self->target, e))
+                return false;
+            self->stream->keepOutput(e);
+            return true;
+        };
+    }
+};
+
+#define TNC_CAPTURE_INSTANCE(member) CaptureInstance member
+#define TNC_CAPTURE_ACTIVATE(member, plugin, sampleRate, minFrames, maxFrames)                  \
+    member.activate(plugin, sampleRate, minFrames, maxFrames)
+#define TNC_CAPTURE_DEACTIVATE(member) member.deactivate()
+#define TNC_CAPTURE_STATE(member, plugin) member.stateLoaded(plugin)
+#define TNC_CAPTURE_PROCESS(member, process) CaptureBlock tncCaptureBlock(member, process)
+#define TNC_CAPTURE_FLUSH(member, in, out) CaptureBlock tncCaptureBlock(member, in, out)
+#define TNC_CAPTURE_LOAD_APPLIED(applied)                                                        \
+    tncCaptureBlock.flags |= (applied) ? (uint32_t)capture::load_applied : 0u
+
+#else
+
+#define TNC_CAPTURE_INSTANCE(member)
+#define TNC_CAPTURE_ACTIVATE(member, plugin, sampleRate, minFrames, maxFrames)
+#define TNC_CAPTURE_DEACTIVATE(member)
+#define TNC_CAPTURE_STATE(member, plugin)
+#define TNC_CAPTURE_PROCESS(member, process)
+#define TNC_CAPTURE_FLUSH(member, in, out)
+#define TNC_CAPTURE_LOAD_APPLIED(applied) (void)(applied)
+
+#endif
+
+#endif // TUNING_NOTE_CLAPS_CAPTURE_H
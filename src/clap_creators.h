@@ -20,5 +20,10 @@
 extern const clap_plugin *create_mtsne(const clap_plugin_descriptor_t *desc, const clap_host *host);
 extern const clap_plugin *create_ednmne(const clap_plugin_descriptor_t *desc,
                                         const clap_host *host);
+extern const clap_plugin *create_ajine(const clap_plugin_descriptor_t *desc,
+                                       const clap_host *host);
+
+// The Scala library preset discovery factory, or nullptr if the id isn't one of its ids
+extern const void *get_preset_discovery_factory(const char *factory_id);
 
 #endif // MTSTONOTEEXPRESSION_CLAP_CREATORS_H
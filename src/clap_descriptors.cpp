@@ -46,7 +46,21 @@ clap_plugin_descriptor EDNM_desc = {
     "Augment a note stream with Pitch Note Expressions to retune using a single EDN-M scale",
     EDNM_features};
 
-uint32_t mtsne_get_plugin_count(const struct clap_plugin_factory *) { return 2; }
+const char *AJI_features[] = {CLAP_PLUGIN_FEATURE_NOTE_EFFECT, "microtonal", "just-intonation",
+                              nullptr};
+clap_plugin_descriptor AJI_desc = {
+    CLAP_VERSION,
+    "org.surge-synth-team.AdaptiveJIToNoteExpression",
+    "Adaptive JI To Note Expression",
+    "Surge Synth Team",
+    "https://surge-synth-team.org",
+    "",
+    "",
+    getProjectVersion(),
+    "Augment a note stream with Pitch Note Expressions to retune held chords to just intervals",
+    AJI_features};
+
+uint32_t mtsne_get_plugin_count(const struct clap_plugin_factory *) { return 3; }
 const clap_plugin_descriptor *mtsne_get_plugin_descriptor(const struct clap_plugin_factory *,
                                                           uint32_t idx)
 {
@@ -57,6 +71,8 @@ const clap_plugin_descriptor *mtsne_get_plugin_descriptor(const struct clap_plug
         return &MTSNE_desc;
     case 1:
         return &EDNM_desc;
+    case 2:
+        return &AJI_desc;
     }
     return nullptr;
 }
@@ -70,6 +86,9 @@ const clap_plugin *mtsne_create_plugin(const struct clap_plugin_factory *, const
     if (strcmp(plugin_id, EDNM_desc.id) == 0)
         return create_ednmne(&EDNM_desc, host);
 
+    if (strcmp(plugin_id, AJI_desc.id) == 0)
+        return create_ajine(&AJI_desc, host);
+
     return nullptr;
 }
 
@@ -88,7 +107,7 @@ const void *mtsne_clap_get_factory(const char *factory_id)
         return &mtsne_clap_plugin_factory;
     }
 
-    return nullptr;
+    return get_preset_discovery_factory(factory_id);
 }
 
 extern "C"
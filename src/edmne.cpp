@@ -21,15 +21,28 @@
 #include <clap/helpers/plugin.hxx>
 #include <clap/helpers/host-proxy.hh>
 #include <clap/helpers/host-proxy.hxx>
+#if __has_include(<clap/ext/preset-load.h>)
+#include <clap/ext/preset-load.h>
+#include <clap/factory/preset-discovery.h>
+#define TNC_HAS_PRESET_LOAD 1
+#endif
 
 #include <iostream>
 #include <iomanip>
 #include <array>
 #include <cmath>
+#include <cstring>
+#include <string>
 
 #include "Tunings.h"
+#include "libMTSMaster.h"
 
 #include "helpers.h"
+#include "key_layout.h"
+#include "preset_index.h"
+#include "triple_buffer.h"
+#include "tuning_bank.h"
+#include "tuning_sequence.h"
 
 
 struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
@@ -39,30 +52,43 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
         : clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
                                 clap::helpers::CheckingLevel::Minimal>(desc, host)
     {
-        for (auto &c : noteRemaining)
-            for (auto &n : c)
-                n = 0.f;
+        sizeNoteStateCore(this);
+        publishParams(this, nullptr, 0);
+        updateInternalTuning();
+        updateSequenceSteps();
+        updateChannelRows();
+        baseRows.fill(internalTables.read().retune.data());
+        activeRows = baseRows;
+    }
 
-        for (auto &c : sclTuning)
-            for (auto &f : c)
-                f = 0.f;
+    ~EDMNE()
+    {
+        if (mtsMasterRegistered)
+        {
+            MTS_DeregisterMaster();
+            mtsMasterRegistered = false;
+        }
+        delete currentBank;
+        delete pendingBank.load();
+        delete retiredBank.load();
     }
 
-    double secondsPerSample{0.f};
+    double sampleRate{0};
     double postNoteRelease{2.0};
 
     int span{2}, divisions{19}, scaleTuningCenter{69};
     double scaleTuningFrequency{440};
 
-    int priorSpan{-1}, priorDivisions{-1}, priorCenter{-1};
-    double priorFrequency{-1};
-
-    Tunings::Tuning tuning;
-
     bool activate(double sampleRate, uint32_t minFrameCount,
                   uint32_t maxFrameCount) noexcept override
     {
-        rebuildTuning();
+        this->sampleRate = sampleRate;
+        updateInternalTuning();
+        updateSequenceSteps();
+        updateChannelRows();
+        baseRowsStale = true;
+        mtsRepublish = true;
+        TNC_CAPTURE_ACTIVATE(capture, clapPlugin(), sampleRate, minFrameCount, maxFrameCount);
         return true;
     }
 
@@ -72,40 +98,679 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
         octave_divisions,
         center,
         frequency,
-        release
+        release,
+        snap_mode,
+        snap_strength,
+        snap_hysteresis,
+        note_ports,
+        sequence_mode,
+        sequence_first_step
+    };
+
+    // Each sequence step has this block of parameters, starting at sequence_first_step
+    enum SequenceStepParam
+    {
+        step_length = 0,
+        step_span,
+        step_divisions,
+        step_center,
+        step_frequency,
+        step_param_count
+    };
+
+    // Parameters added after the sequence block
+    static constexpr int mts_master =
+        sequence_first_step + TuningSequence::maxSteps * step_param_count;
+    static constexpr int key_layout = mts_master + 1;
+    static constexpr int maxKeyLayouts = 16;
+    static constexpr int tuning_bank = key_layout + 1;
+    static constexpr int bank_program = tuning_bank + 1;
+    static constexpr int maxTuningBanks = 16;
+    static constexpr int channel_tuning = bank_program + 1;
+    static constexpr int channel_first = channel_tuning + 1;
+
+    // With per channel tuning on, each MIDI channel has this block, starting at channel_first
+    enum ChannelParam
+    {
+        channel_span = 0,
+        channel_divisions,
+        channel_center,
+        channel_frequency,
+        channel_param_count
     };
+    static constexpr int scala_preset = channel_first + 16 * channel_param_count;
+    static constexpr int port_channel_first = scala_preset + 1;
+    static constexpr int paramCount = port_channel_first + maxNotePorts;
+
+    bool sequenceParam(clap_id paramId, int &step, int &which) const
+    {
+        if (paramId < paramIdBase + sequence_first_step || paramId >= paramIdBase + mts_master)
+            return false;
+        auto idx = (int)(paramId - paramIdBase - sequence_first_step);
+        step = idx / step_param_count;
+        which = idx % step_param_count;
+        return true;
+    }
+
+    bool channelParam(clap_id paramId, int &channel, int &which) const
+    {
+        if (paramId < paramIdBase + channel_first ||
+            paramId >= paramIdBase + channel_first + 16 * channel_param_count)
+            return false;
+        auto idx = (int)(paramId - paramIdBase - channel_first);
+        channel = idx / channel_param_count;
+        which = idx % channel_param_count;
+        return true;
+    }
+
+    bool portChannelParam(clap_id paramId, int &port) const
+    {
+        if (paramId < paramIdBase + port_channel_first || paramId >= paramIdBase + paramCount)
+            return false;
+        port = (int)(paramId - paramIdBase - port_channel_first);
+        return true;
+    }
 
     bool implementsNotePorts() const noexcept override { return true; }
-    uint32_t notePortsCount(bool isInput) const noexcept override { return 1; }
+    uint32_t notePortsCount(bool isInput) const noexcept override { return notePorts; }
     bool notePortsInfo(uint32_t index, bool isInput,
                        clap_note_port_info *info) const noexcept override
     {
-        info->id = 1 + (isInput ? 1 : 0);
-        info->supported_dialects = CLAP_NOTE_DIALECT_CLAP | CLAP_NOTE_DIALECT_MIDI |
-                                   CLAP_NOTE_DIALECT_MIDI_MPE | CLAP_NOTE_DIALECT_MIDI2;
-        info->preferred_dialect = CLAP_NOTE_DIALECT_CLAP;
-        if (isInput)
+        return notePortsInfoCore(index, isInput, "EDMN", info);
+    }
+
+    uint32_t notePorts{1};
+    std::atomic<uint32_t> requestedNotePorts{1};
+
+    // 0 plays the row of the note's own channel, 1-16 forces a channel's row for the port
+    std::array<int, maxNotePorts> portTuningChannel{};
+
+    void deactivate() noexcept override
+    {
+        TNC_CAPTURE_DEACTIVATE(capture);
+        if (requestedNotePorts != notePorts)
+            _host.requestCallback();
+    }
+
+    void onMainThread() noexcept override
+    {
+        updateNotePortsCore(this, _host, isActive());
+        updateMtsMaster();
+        updateInternalTuning();
+        updateKeyLayout();
+        updateSequenceSteps();
+        updateChannelRows();
+        updateTuningBank();
+    }
+
+    /*
+     * A tuning bank is mapped on the main thread and handed to process() through pendingBank.
+     * process() only swaps pointers, parking the bank it stops using in retiredBank for the
+     * main thread to unmap. A new bank waits until that slot is empty, so the audio thread
+     * never frees anything and never blocks.
+     */
+    struct LoadedBank
+    {
+        std::unique_ptr<TuningBank> bank;
+    };
+    std::atomic<int> requestedBank{0};
+    int loadedBank{0};
+    bool bankFound{false};
+    std::atomic<LoadedBank *> pendingBank{nullptr}, retiredBank{nullptr};
+    LoadedBank *currentBank{nullptr}; // owned by whichever thread runs process
+    int bankProgram{0};
+    bool baseRowsStale{false};
+
+    void updateTuningBank()
+    {
+        delete retiredBank.exchange(nullptr);
+
+        auto req = requestedBank.load();
+        if (req == loadedBank || pendingBank.load())
+            return;
+
+        auto nb = new LoadedBank();
+        if (req != 0)
+            nb->bank = TuningBank::open(userDataDirectory() + "/banks/bank-" +
+                                        std::to_string(req) + ".tncbank");
+        bankFound = nb->bank != nullptr;
+        loadedBank = req;
+        pendingBank = nb;
+
+        // With no process() running we stand in for it
+        if (!isActive() && consumeBank())
+            delete retiredBank.exchange(nullptr);
+    }
+
+    bool consumeBank()
+    {
+        if (retiredBank.load())
+            return false;
+        auto b = pendingBank.exchange(nullptr);
+        if (!b)
+            return false;
+        retiredBank = currentBank;
+        currentBank = b;
+        baseRowsStale = true;
+        return true;
+    }
+
+    /*
+     * Resolve the base rows. Each channel plays the first of the bank program, its per channel
+     * EDN-M, the Scala preset, the key layout and our own EDN-M which is on. A sequence step
+     * replaces all of them in setActiveRows. Retuning, snapping and the MTS-ESP tables all
+     * read the resulting rows, so they never disagree.
+     */
+    void selectBaseRows()
+    {
+        auto b = currentBank ? currentBank->bank.get() : nullptr;
+        const auto &l = layoutTables.read();
+        for (int c = 0; c < 16; ++c)
+        {
+            if (b && (uint32_t)bankProgram < b->count())
+                baseRows[c] = b->table(bankProgram, c);
+            else if (channelMode)
+                baseRows[c] = channelRows[c];
+            else if (scalaPreset && presetLoaded)
+                baseRows[c] = presetTuning.data();
+            else
+                baseRows[c] = l.active ? l.retune[c].data() : internalTables.read().retune.data();
+        }
+    }
+
+    /*
+     * Per channel tuning gives each MIDI channel its own EDN-M. The tables are built here on
+     * the main thread from the parameter snapshot and handed to process() through a triple
+     * buffer, like a key layout. They live in one contiguous 16x128 block and channels with
+     * the same settings point at the same row, so sixteen parts in a handful of tunings touch
+     * only a handful of rows. A row is computed only for settings no row held before.
+     */
+    struct ChannelSettings
+    {
+        int span{2}, divisions{19}, center{69};
+        double frequency{440};
+
+        bool operator==(const ChannelSettings &o) const
+        {
+            return span == o.span && divisions == o.divisions && center == o.center &&
+                   frequency == o.frequency;
+        }
+        bool operator!=(const ChannelSettings &o) const { return !(*this == o); }
+    };
+    struct ChannelTable
+    {
+        bool built{false};
+        int rows{0};
+        std::array<ChannelSettings, 16> settings;    // what each channel asked for
+        std::array<ChannelSettings, 16> rowSettings; // what each row holds
+        std::array<uint8_t, 16> rowOf{};
+        std::array<std::array<double, 128>, 16> tuning{};
+    };
+    TripleBuffer<ChannelTable> channelTables;
+    ChannelTable channelMain; // main thread
+    bool channelMode{false};
+    bool channelsMoved{false};                       // audio thread
+    std::array<ChannelSettings, 16> channelSettings; // audio thread
+    std::array<const double *, 16> channelRows;
+
+    void updateChannelRows()
+    {
+        const auto &v = params.values();
+        std::array<ChannelSettings, 16> want;
+        for (int c = 0; c < 16; ++c)
         {
-            strncpy(info->name, "EDMN Note Input", CLAP_NAME_SIZE);
+            auto b = channel_first + c * channel_param_count;
+            want[c] = {(int)v[b + channel_span], (int)v[b + channel_divisions],
+                       (int)v[b + channel_center], v[b + channel_frequency]};
+        }
+        if (channelMain.built && want == channelMain.settings)
+            return;
+
+        TNC_TRACE_SCOPE(trace.main, "updateChannelRows");
+        auto &t = channelTables.writeBuffer();
+        t.rows = 0;
+        for (int c = 0; c < 16; ++c)
+        {
+            const auto &cs = want[c];
+            int shared = 0;
+            while (shared < c && want[shared] != cs)
+                shared++;
+            if (shared < c)
+            {
+                t.rowOf[c] = t.rowOf[shared];
+                continue;
+            }
+
+            auto r = t.rows++;
+            int have = 0;
+            while (have < channelMain.rows && channelMain.rowSettings[have] != cs)
+                have++;
+            if (have < channelMain.rows)
+            {
+                t.tuning[r] = channelMain.tuning[have];
+            }
+            else
+            {
+                auto sc = Tunings::evenDivisionOfSpanByM(cs.span, cs.divisions);
+                auto km = Tunings::tuneNoteTo(cs.center, cs.frequency);
+                fillRetuning(Tunings::Tuning(sc, km), t.tuning[r]);
+            }
+            t.rowSettings[r] = cs;
+            t.rowOf[c] = (uint8_t)r;
+        }
+        t.settings = want;
+        t.built = true;
+        channelMain = t;
+        channelTables.publish();
+
+        // With no process() running we stand in for it
+        if (!isActive() && channelTables.consume())
+            takeChannelRows();
+    }
+
+    void takeChannelRows()
+    {
+        const auto &t = channelTables.read();
+        for (int c = 0; c < 16; ++c)
+            channelRows[c] = t.tuning[t.rowOf[c]].data();
+        baseRowsStale = true;
+    }
+
+    /*
+     * A Scala preset, opened from the host's preset browser, is read and turned into a row on
+     * the main thread and handed to process() like a key layout. It stands in for our own
+     * EDN-M and any key layout while the Scala Preset parameter is on, below banks and per
+     * channel tuning.
+     */
+    struct ScalaTable
+    {
+        bool loaded{false};
+        std::array<double, 128> retune{};
+    };
+    TripleBuffer<ScalaTable> presetTables;
+    ScalaTable presetMain; // main thread
+    std::string presetName;
+    bool scalaPreset{false}, presetLoaded{false}; // audio thread
+    std::array<double, 128> presetTuning{};
+
+    static constexpr clap_id presetTableId = 188632; // paramIdBase + 1000, in the state only
+
+    std::string presetDisplayName() const
+    {
+        return presetName.empty() ? std::string("Scala Scale") : presetName;
+    }
+
+    void publishPresetTable()
+    {
+        presetTables.writeBuffer() = presetMain;
+        presetTables.publish();
+        if (!isActive())
+        {
+            presetTables.consume();
+            presetLoaded = presetMain.loaded;
+            presetTuning = presetMain.retune;
+            baseRowsStale = true;
+        }
+    }
+
+    bool loadScalaPreset(const std::string &path)
+    {
+        TNC_TRACE_SCOPE(trace.main, "loadScalaPreset");
+        try
+        {
+            auto sc = Tunings::readSCLFile(path);
+            auto kbm = mappingFor(path);
+            auto km = kbm.empty() ? Tunings::KeyboardMapping() : Tunings::readKBMFile(kbm);
+            fillRetuning(Tunings::Tuning(sc, km), presetMain.retune);
+        }
+        catch (const Tunings::TuningError &e)
+        {
+            reportPresetError(path, e.what());
+            return false;
+        }
+        presetMain.loaded = true;
+
+        auto slash = path.find_last_of("/\\");
+        presetName = slash == std::string::npos ? path : path.substr(slash + 1);
+        auto dot = presetName.find_last_of('.');
+        if (dot != std::string::npos)
+            presetName = presetName.substr(0, dot);
+
+        publishPresetTable();
+        params.post({{paramIdBase + scala_preset, 1.0}}, paramIdBase);
+        if (!isActive())
+        {
+            applyLoadedParams(this);
+            publishParams(this, nullptr, 0);
         }
         else
         {
-            strncpy(info->name, "EDMN Note Output", CLAP_NAME_SIZE);
+            _host.requestProcess();
         }
+        if (_host.canUseParams())
+            _host.paramsRescan(CLAP_PARAM_RESCAN_VALUES | CLAP_PARAM_RESCAN_TEXT);
+        TNC_CAPTURE_STATE(capture, clapPlugin());
         return true;
     }
 
+    // A host which shows preset load failures hears why the scale couldn't be read
+    void reportPresetError(const std::string &path, const char *msg)
+    {
+#if TNC_HAS_PRESET_LOAD
+        auto h = _host.host();
+        auto pl = static_cast<const clap_host_preset_load *>(
+            h->get_extension(h, CLAP_EXT_PRESET_LOAD));
+        if (!pl)
+            pl = static_cast<const clap_host_preset_load *>(
+                h->get_extension(h, CLAP_EXT_PRESET_LOAD_COMPAT));
+        if (pl && pl->on_error)
+            pl->on_error(h, CLAP_PRESET_DISCOVERY_LOCATION_FILE, path.c_str(), nullptr, 0, msg);
+#endif
+    }
+
+#if TNC_HAS_PRESET_LOAD
+    const void *extension(const char *id) noexcept override
+    {
+        static const clap_plugin_preset_load presetLoad = {
+            [](const clap_plugin *plugin, uint32_t kind, const char *location,
+               const char *) -> bool {
+                if (kind != CLAP_PRESET_DISCOVERY_LOCATION_FILE || !location)
+                    return false;
+                auto self = static_cast<EDMNE *>(static_cast<Plugin *>(plugin->plugin_data));
+                return self->loadScalaPreset(location);
+            }};
+        if (strcmp(id, CLAP_EXT_PRESET_LOAD) == 0 || strcmp(id, CLAP_EXT_PRESET_LOAD_COMPAT) == 0)
+            return &presetLoad;
+        return nullptr;
+    }
+#endif
+
+    void setActiveRows()
+    {
+        for (int c = 0; c < 16; ++c)
+            activeRows[c] = activeStep < 0 ? baseRows[c]
+                                           : sequenceTables.read().tuning[activeStep].data();
+        snap.rebuild(activeRows);
+        rebuildCount++;
+    }
+
+    /*
+     * A key layout is read and turned into its 16x128 table here on the main thread, then
+     * handed to process() through a triple buffer, where its rows stand in for our own EDN-M.
+     * The table follows the base EDN-M settings in the parameter snapshot, so process() asks
+     * for a new one, once the block which moved them has published, and we rebuild if they
+     * differ from what the table was built for.
+     */
+    std::atomic<int> requestedLayout{0};
+    bool baseMoved{false}; // audio thread
+    int loadedLayout{0};
+    bool layoutFound{false};
+    std::array<double, 4> layoutBase{};
+    KeyLayout layout;
+    TripleBuffer<KeyLayoutTable> layoutTables;
+
+    void updateKeyLayout()
+    {
+        auto req = requestedLayout.load();
+        const auto &v = params.values();
+        std::array<double, 4> base{v[octave_span], v[octave_divisions], v[center], v[frequency]};
+        if (req == loadedLayout && (req == 0 || base == layoutBase))
+            return;
+
+        if (req != loadedLayout)
+        {
+            loadedLayout = req;
+            layoutFound = req != 0 && layout.load(KeyLayout::pathFor(req));
+        }
+
+        layoutBase = base;
+        auto &t = layoutTables.writeBuffer();
+        t.active = req != 0;
+        if (t.active)
+            t.build(layout, (int)base[0], (int)base[1], (int)base[2], base[3]);
+        layoutTables.publish();
+    }
+
+    /*
+     * Our own EDN-M is built here on the main thread from the parameter snapshot too and
+     * handed to process() through a triple buffer, so moving its parameters never builds a
+     * tuning on the audio thread.
+     */
+    struct InternalTable
+    {
+        bool built{false};
+        std::array<double, 4> base{};
+        std::array<double, 128> retune{};
+    };
+    TripleBuffer<InternalTable> internalTables;
+    InternalTable internalMain; // main thread
+
+    void updateInternalTuning()
+    {
+        const auto &v = params.values();
+        std::array<double, 4> base{v[octave_span], v[octave_divisions], v[center], v[frequency]};
+        if (internalMain.built && base == internalMain.base)
+            return;
+
+        TNC_TRACE_SCOPE(trace.main, "updateInternalTuning");
+        auto sc = Tunings::evenDivisionOfSpanByM((int)base[0], (int)base[1]);
+        auto km = Tunings::tuneNoteTo((int)base[2], base[3]);
+        fillRetuning(Tunings::Tuning(sc, km), internalMain.retune);
+        internalMain.base = base;
+        internalMain.built = true;
+        internalTables.writeBuffer() = internalMain;
+        internalTables.publish();
+
+        // With no process() running we stand in for it
+        if (!isActive() && internalTables.consume())
+            baseRowsStale = true;
+    }
+
+    // Once the block which moved them has published, the main thread rebuilds the tables
+    // which follow the parameters
+    void requestTableRefresh()
+    {
+        if (baseMoved || channelsMoved || stepsMoved)
+            _host.requestCallback();
+        baseMoved = channelsMoved = stepsMoved = false;
+    }
+
+    /*
+     * As an MTS-ESP master we publish the active rows for every MTS client to read. The
+     * registration and the scale name go through the main thread, while the note tunings are
+     * written from process() whenever the rows change, since that is where the sequence
+     * swaps them.
+     */
+    std::atomic<bool> mtsMasterRequested{false};
+    std::atomic<bool> mtsMasterRegistered{false};
+    std::atomic<bool> mtsRepublish{false}, mtsNameChanged{false};
+    std::atomic<int> publishedStep{-1}, publishedProgram{0};
+    uint64_t publishedGeneration{0};
+
+    void updateMtsMaster()
+    {
+        if (mtsMasterRequested && !mtsMasterRegistered)
+        {
+            if (!MTS_CanRegisterMaster())
+                return;
+            MTS_RegisterMaster();
+            mtsMasterRegistered = true;
+
+            // With no audio thread running nothing else would publish the table
+            if (isActive())
+            {
+                mtsRepublish = true;
+                _host.requestProcess();
+            }
+            else
+            {
+                publishMtsTables();
+            }
+            mtsNameChanged = true;
+        }
+        else if (!mtsMasterRequested && mtsMasterRegistered)
+        {
+            mtsMasterRegistered = false;
+            MTS_DeregisterMaster();
+            return;
+        }
+
+        if (mtsMasterRegistered && mtsNameChanged.exchange(false))
+            MTS_SetScaleName(scaleName(publishedStep).c_str());
+    }
+
+    std::string scaleName(int step)
+    {
+        if (step < 0 && loadedBank != 0 && bankFound)
+            return "Bank " + std::to_string(loadedBank) + " Program " +
+                   std::to_string(publishedProgram.load());
+
+        const auto &v = params.values();
+        if (step < 0 && v[channel_tuning] < 0.5 && v[scala_preset] > 0.5 && presetMain.loaded)
+            return presetDisplayName();
+
+        int first = octave_span;
+        if (step >= 0)
+            first = sequence_first_step + step * step_param_count + step_span;
+        else if (v[channel_tuning] > 0.5)
+            first = channel_first; // MTS-ESP has one scale name, so it describes channel 1
+
+        // Each of these blocks has span, divisions, center and frequency in a row
+        std::ostringstream oss;
+        oss << (int)v[first + 1] << "ED" << (int)v[first] << " (key " << (int)v[first + 2]
+            << " = " << std::setprecision(6) << v[first + 3] << " Hz)";
+        return oss.str();
+    }
+
+    // Clients which ask per channel hear each channel's row; the others hear channel 1
+    void publishMtsTables()
+    {
+        double freqs[128];
+        auto fill = [&freqs](const double *row) {
+            for (int k = 0; k < 128; ++k)
+                freqs[k] = 440.0 * std::pow(2.0, (k - 69 + row[k]) / 12.0);
+        };
+        fill(activeRows[0]);
+        MTS_SetNoteTunings(freqs);
+        for (int c = 0; c < 16; ++c)
+        {
+            auto own = activeRows[c] != activeRows[0];
+            MTS_SetMultiChannel(own, (char)c);
+            if (!own)
+                continue;
+            fill(activeRows[c]);
+            MTS_SetMultiChannelNoteTunings(freqs, (char)c);
+        }
+    }
+
     static constexpr int paramIdBase = 187632;
     bool implementsParams() const noexcept override { return true; }
     bool isValidParamId(clap_id paramId) const noexcept override
     {
-        return paramId >= paramIdBase && paramId <= paramIdBase + paramsCount();
+        return paramId >= paramIdBase && paramId < paramIdBase + paramsCount();
+    }
+    uint32_t paramsCount() const noexcept override
+    {
+        return paramCount;
     }
-    uint32_t paramsCount() const noexcept override { return 5; }
     bool paramsInfo(uint32_t paramIndex, clap_param_info *info) const noexcept override
     {
         info->id = paramIndex + paramIdBase;
 
+        int step, which;
+        if (sequenceParam(info->id, step, which))
+        {
+            auto mod = "Sequence Step " + std::to_string(step + 1);
+            strncpy(info->module, mod.c_str(), CLAP_NAME_SIZE);
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            switch (which)
+            {
+            case step_length:
+                strncpy(info->name, (mod + " Length (beats)").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 0;
+                info->max_value = 64;
+                info->default_value = 4;
+                info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+                break;
+            case step_span:
+                strncpy(info->name, (mod + " Even Division Of").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 2;
+                info->max_value = 6;
+                info->default_value = 2;
+                break;
+            case step_divisions:
+                strncpy(info->name, (mod + " Into Steps").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 3;
+                info->max_value = 72;
+                info->default_value = 19;
+                break;
+            case step_center:
+                strncpy(info->name, (mod + " Tuning Center Key").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 0;
+                info->max_value = 127;
+                info->default_value = 69;
+                break;
+            case step_frequency:
+                strncpy(info->name, (mod + " Tuning Center Frequency").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 220;
+                info->max_value = 880;
+                info->default_value = 440;
+                info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+                break;
+            }
+            return true;
+        }
+
+        int port;
+        if (portChannelParam(info->id, port))
+        {
+            auto nm = "Port " + std::to_string(port + 1) + " Tuning Channel";
+            strncpy(info->name, nm.c_str(), CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 16;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            return true;
+        }
+
+        int ch;
+        if (channelParam(info->id, ch, which))
+        {
+            auto mod = "Channel " + std::to_string(ch + 1);
+            strncpy(info->module, mod.c_str(), CLAP_NAME_SIZE);
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            switch (which)
+            {
+            case channel_span:
+                strncpy(info->name, (mod + " Even Division Of").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 2;
+                info->max_value = 6;
+                info->default_value = 2;
+                break;
+            case channel_divisions:
+                strncpy(info->name, (mod + " Into Steps").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 3;
+                info->max_value = 72;
+                info->default_value = 19;
+                break;
+            case channel_center:
+                strncpy(info->name, (mod + " Tuning Center Key").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 0;
+                info->max_value = 127;
+                info->default_value = 69;
+                break;
+            case channel_frequency:
+                strncpy(info->name, (mod + " Tuning Center Frequency").c_str(), CLAP_NAME_SIZE);
+                info->min_value = 220;
+                info->max_value = 880;
+                info->default_value = 440;
+                info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+                break;
+            }
+            return true;
+        }
+
         switch (paramIndex)
         {
         case octave_span:
@@ -153,6 +818,105 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             info->default_value = 2;
             info->flags = CLAP_PARAM_IS_AUTOMATABLE;
             break;
+        case snap_mode:
+            strncpy(info->name, "Snap Expressions To Scale", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case snap_strength:
+            strncpy(info->name, "Snap Strength", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 1;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case snap_hysteresis:
+            strncpy(info->name, "Snap Hysteresis (cents)", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 50;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case note_ports:
+            strncpy(info->name, "Note Ports", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 1;
+            info->max_value = maxNotePorts;
+            info->default_value = 1;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        case sequence_mode:
+            strncpy(info->name, "Tuning Sequence", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case mts_master:
+            strncpy(info->name, "Publish As MTS-ESP Master", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        case key_layout:
+            strncpy(info->name, "Key Layout", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = maxKeyLayouts;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        case tuning_bank:
+            strncpy(info->name, "Tuning Bank", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = maxTuningBanks;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        case bank_program:
+            strncpy(info->name, "Bank Program", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 127;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case channel_tuning:
+            strncpy(info->name, "Per Channel Tuning", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case scala_preset:
+            strncpy(info->name, "Scala Preset", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
         default:
             return false;
         }
@@ -161,25 +925,93 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
     }
     bool paramsValue(clap_id paramId, double *value) noexcept override
     {
+        if (!isValidParamId(paramId))
+            return false;
+        *value = params.values()[paramId - paramIdBase];
+        return true;
+    }
+
+    // The audio thread's view, which publishParams copies into the snapshot
+    double liveParamValue(clap_id paramId) const
+    {
+        int step, which;
+        if (sequenceParam(paramId, step, which))
+        {
+            const auto &s = sequence.steps[step];
+            switch (which)
+            {
+            case step_length:
+                return s.length;
+            case step_span:
+                return s.span;
+            case step_divisions:
+                return s.divisions;
+            case step_center:
+                return s.center;
+            case step_frequency:
+                return s.frequency;
+            }
+            return 0;
+        }
+
+        int port;
+        if (portChannelParam(paramId, port))
+            return portTuningChannel[port];
+
+        int ch;
+        if (channelParam(paramId, ch, which))
+        {
+            const auto &cs = channelSettings[ch];
+            switch (which)
+            {
+            case channel_span:
+                return cs.span;
+            case channel_divisions:
+                return cs.divisions;
+            case channel_center:
+                return cs.center;
+            case channel_frequency:
+                return cs.frequency;
+            }
+            return 0;
+        }
+
         switch (paramId)
         {
         case paramIdBase + octave_span:
-            *value = span;
-            break;
+            return span;
         case paramIdBase + octave_divisions:
-            *value = divisions;
-            break;
+            return divisions;
         case paramIdBase + center:
-            *value = scaleTuningCenter;
-            break;
+            return scaleTuningCenter;
         case paramIdBase + frequency:
-            *value = scaleTuningFrequency;
-            break;
+            return scaleTuningFrequency;
         case paramIdBase + release:
-            *value = postNoteRelease;
-            break;
+            return postNoteRelease;
+        case paramIdBase + snap_mode:
+            return snap.active ? 1 : 0;
+        case paramIdBase + snap_strength:
+            return snap.strength;
+        case paramIdBase + snap_hysteresis:
+            return snap.hysteresis * 100.0;
+        case paramIdBase + note_ports:
+            return requestedNotePorts;
+        case paramIdBase + sequence_mode:
+            return sequence.active ? 1 : 0;
+        case paramIdBase + mts_master:
+            return mtsMasterRequested ? 1 : 0;
+        case paramIdBase + key_layout:
+            return requestedLayout;
+        case paramIdBase + tuning_bank:
+            return requestedBank;
+        case paramIdBase + bank_program:
+            return bankProgram;
+        case paramIdBase + channel_tuning:
+            return channelMode ? 1 : 0;
+        case paramIdBase + scala_preset:
+            return scalaPreset ? 1 : 0;
         }
-        return true;
+        return 0;
     }
 
     bool paramsValueToText(clap_id paramId, double value, char *display,
@@ -187,11 +1019,54 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
     {
         memset(display, 0, size * sizeof(char));
 
+        int step, which;
+        if (sequenceParam(paramId, step, which))
+        {
+            std::ostringstream oss;
+            switch (which)
+            {
+            case step_length:
+                oss << std::setprecision(4) << value << " beats";
+                break;
+            case step_frequency:
+                oss << std::setprecision(8) << value << " Hz";
+                break;
+            default:
+                oss << (int)value;
+                break;
+            }
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+
+        int port;
+        if (portChannelParam(paramId, port))
+        {
+            if (value < 0.5)
+                strncpy(display, "Note Channel", size - 1);
+            else
+                strncpy(display, ("Channel " + std::to_string((int)value)).c_str(), size - 1);
+            return true;
+        }
+
+        int ch;
+        if (channelParam(paramId, ch, which))
+        {
+            std::ostringstream oss;
+            if (which == channel_frequency)
+                oss << std::setprecision(8) << value << " Hz";
+            else
+                oss << (int)value;
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+
         switch (paramId)
         {
         case paramIdBase + octave_divisions:
         case paramIdBase + octave_span:
         case paramIdBase + center:
+        case paramIdBase + note_ports:
         {
             strncpy(display, std::to_string((int)value).c_str(), size-1);
             return true;
@@ -210,23 +1085,166 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             strncpy(display, oss.str().c_str(), size-1);
             return true;
         }
+        case paramIdBase + snap_mode:
+        {
+            if (value > 0.5)
+                strncpy(display, "Snap To Scale", size - 1);
+            else
+                strncpy(display, "Off", size - 1);
+            return true;
+        }
+        case paramIdBase + sequence_mode:
+        {
+            if (value > 0.5)
+                strncpy(display, "Follow Transport", size - 1);
+            else
+                strncpy(display, "Off", size - 1);
+            return true;
+        }
+        case paramIdBase + channel_tuning:
+        {
+            if (value > 0.5)
+                strncpy(display, "Per Channel", size - 1);
+            else
+                strncpy(display, "Off", size - 1);
+            return true;
+        }
+        case paramIdBase + scala_preset:
+        {
+            if (value < 0.5)
+                strncpy(display, "Off", size - 1);
+            else if (!presetMain.loaded)
+                strncpy(display, "None Loaded", size - 1);
+            else
+                strncpy(display, presetDisplayName().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + mts_master:
+        {
+            if (value < 0.5)
+                strncpy(display, "Off", size - 1);
+            else if (mtsMasterRegistered)
+                strncpy(display, "Publishing", size - 1);
+            else
+                strncpy(display, "Another Master Is Active", size - 1);
+            return true;
+        }
+        case paramIdBase + key_layout:
+        {
+            auto idx = (int)std::round(value);
+            if (idx == 0)
+            {
+                strncpy(display, "Off", size - 1);
+                return true;
+            }
+            auto nm = "layout-" + std::to_string(idx) + ".txt";
+            if (idx == loadedLayout && !layoutFound)
+                nm += " (not found)";
+            strncpy(display, nm.c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + tuning_bank:
+        {
+            auto idx = (int)std::round(value);
+            if (idx == 0)
+            {
+                strncpy(display, "Off", size - 1);
+                return true;
+            }
+            auto nm = "bank-" + std::to_string(idx) + ".tncbank";
+            if (idx == loadedBank && !bankFound)
+                nm += " (not found)";
+            strncpy(display, nm.c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + bank_program:
+        {
+            strncpy(display, std::to_string((int)value).c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + snap_strength:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(3) << value * 100.0 << " %";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + snap_hysteresis:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(3) << value << " cents";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
         }
         return false;
     }
 
     bool paramsTextToValue(clap_id paramId, const char *display, double *value) noexcept override
     {
+        int step, which;
+        if (sequenceParam(paramId, step, which) || channelParam(paramId, step, which))
+        {
+            *value = std::atof(display);
+            return true;
+        }
+
+        if (portChannelParam(paramId, step))
+        {
+            if (strncmp(display, "Channel ", 8) == 0)
+                display += 8;
+            *value = std::atoi(display);
+            return true;
+        }
+
         switch (paramId)
         {
         case paramIdBase + octave_divisions:
         case paramIdBase + octave_span:
         case paramIdBase + center:
+        case paramIdBase + note_ports:
+        {
+            *value = std::atoi(display);
+            return true;
+        }
+        case paramIdBase + snap_mode:
+        case paramIdBase + sequence_mode:
+        case paramIdBase + mts_master:
+        case paramIdBase + channel_tuning:
+        case paramIdBase + scala_preset:
+        {
+            *value = (strcmp(display, "Off") == 0) ? 0 : 1;
+            return true;
+        }
+        case paramIdBase + key_layout:
+        {
+            int idx = 0;
+            if (sscanf(display, "layout-%d", &idx) != 1)
+                idx = std::atoi(display);
+            *value = idx;
+            return true;
+        }
+        case paramIdBase + tuning_bank:
+        {
+            int idx = 0;
+            if (sscanf(display, "bank-%d", &idx) != 1)
+                idx = std::atoi(display);
+            *value = idx;
+            return true;
+        }
+        case paramIdBase + bank_program:
         {
             *value = std::atoi(display);
             return true;
         }
+        case paramIdBase + snap_strength:
+        {
+            *value = std::atof(display) / 100.0;
+            return true;
+        }
         case paramIdBase + frequency:
         case paramIdBase + release:
+        case paramIdBase + snap_hysteresis:
         {
             *value = std::atof(display);
             return true;
@@ -236,104 +1254,374 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
     }
 
     char priorScaleName[CLAP_NAME_SIZE];
-    std::array<std::array<float, 128>, 16>
-        noteRemaining; // -1 means still held, otherwise its the time
-    std::array<std::array<double, 128>, 16> sclTuning;
-    std::array<double, 128> internalTuning;
+    TNC_TRACE_INSTANCE(trace, "EDMNE");
+    TNC_CAPTURE_INSTANCE(capture);
+    NoteArray<uint8_t> noteState;
+    ReleaseWheel releases; // deadlines of releasing notes, in samples
+    uint64_t sampleClock{0};
+    NoteArray<double> sclTuning;
+    NoteArray<double> expressionTuning; // the last inbound tuning expression per note
+    uint64_t retunedGeneration{0};
+    ScaleSnap snap;
+
+    /*
+     * The table for each sequence step is built here on the main thread from the parameter
+     * snapshot and handed to process() through a triple buffer, like a key layout, so
+     * changing step in process() is just a swap of row pointers. Only a step whose settings
+     * moved is computed again.
+     */
+    struct SequenceTable
+    {
+        bool built{false};
+        std::array<std::array<double, 4>, TuningSequence::maxSteps> base{};
+        std::array<std::array<double, 128>, TuningSequence::maxSteps> tuning{};
+    };
+    TuningSequence sequence;
+    TripleBuffer<SequenceTable> sequenceTables;
+    SequenceTable sequenceMain; // main thread
+    bool stepsMoved{false};     // audio thread
+    int activeStep{-1};
+
+    void updateSequenceSteps()
+    {
+        const auto &v = params.values();
+        bool moved = false;
+        for (int i = 0; i < TuningSequence::maxSteps; ++i)
+        {
+            auto b = sequence_first_step + i * step_param_count;
+            std::array<double, 4> base{v[b + step_span], v[b + step_divisions],
+                                       v[b + step_center], v[b + step_frequency]};
+            if (sequenceMain.built && base == sequenceMain.base[i])
+                continue;
+
+            TNC_TRACE_SCOPE(trace.main, "rebuildSequenceStep");
+            auto sc = Tunings::evenDivisionOfSpanByM((int)base[0], (int)base[1]);
+            auto km = Tunings::tuneNoteTo((int)base[2], base[3]);
+            fillRetuning(Tunings::Tuning(sc, km), sequenceMain.tuning[i]);
+            sequenceMain.base[i] = base;
+            moved = true;
+        }
+        if (!moved)
+            return;
+
+        sequenceMain.built = true;
+        sequenceTables.writeBuffer() = sequenceMain;
+        sequenceTables.publish();
+
+        // With no process() running we stand in for it
+        if (!isActive() && sequenceTables.consume())
+            baseRowsStale = true;
+    }
+
+    // The rows in force for each channel; baseRows is what we fall back to between steps
+    std::array<const double *, 16> baseRows, activeRows;
+
+    ParamSnapshot<paramCount> params;
 
     bool implementsState() const noexcept override { return true; }
     bool stateSave(const clap_ostream *stream) noexcept override
     {
         std::map<clap_id, double> vals;
-        vals[paramIdBase + octave_span] = span;
-        vals[paramIdBase + octave_divisions] = divisions;
-        vals[paramIdBase + center] = scaleTuningCenter;
-        vals[paramIdBase + frequency] = scaleTuningFrequency;
-        vals[paramIdBase + release] = postNoteRelease;
+        const auto &v = params.values();
+        for (int i = 0; i < paramCount; ++i)
+            vals[paramIdBase + i] = v[i];
+        if (presetMain.loaded)
+            for (int k = 0; k < 128; ++k)
+                vals[presetTableId + k] = presetMain.retune[k];
         return helpersStateSave(stream, vals);
     }
     bool stateLoad(const clap_istream *stream) noexcept override
     {
+        TNC_TRACE_SCOPE(trace.main, "stateLoad");
         std::map<clap_id, double> vals;
         auto res = helpersStateLoad(stream, vals);
         if (!res)
             return false;
 
-        span = vals[paramIdBase + octave_span];
-        divisions = vals[paramIdBase + octave_divisions];
-        scaleTuningCenter = vals[paramIdBase + center];
-        scaleTuningFrequency = vals[paramIdBase + frequency];
-        postNoteRelease = vals[paramIdBase + release];
+        // The preset table travels with the state, so the session doesn't need the .scl file
+        presetMain.loaded = vals.count(presetTableId) != 0;
+        for (int k = 0; k < 128 && presetMain.loaded; ++k)
+            presetMain.retune[k] = vals[presetTableId + k];
+        presetName.clear();
+        publishPresetTable();
+
+        // The audio thread applies the values at its next block; with none running we do.
+        // Older sessions lack the later parameters, which then go back to their defaults.
+        fillParamDefaults(this, vals);
+        params.post(vals, paramIdBase);
+        if (!isActive())
+        {
+            applyLoadedParams(this);
+            publishParams(this, nullptr, 0);
+            onMainThread();
+        }
 
+        TNC_CAPTURE_STATE(capture, clapPlugin());
         return true;
     }
 
     bool tuningActive() { return true; }
-    double retuningFor(int key, int channel) { return internalTuning[key]; }
+    uint64_t tuningGeneration() { return rebuildCount; }
+    int tuningChannel(int port, int channel)
+    {
+        return portTuningChannel[port] ? portTuningChannel[port] - 1 : channel;
+    }
+    double retuningFor(int key, int channel) { return activeRows[channel][key]; }
+
+    void heldNoteOn(int key) {}
+    void heldNoteOff(int key) {}
+    const int16_t *retunedKeys(int &count) { return nullptr; }
+    bool noteFiltered(int port, int channel, int key) const { return false; }
+
+    // A program change picks the bank entry from the sample it arrives on
+    void handleMidi(const clap_event_midi *mevt)
+    {
+        if ((mevt->data[0] & 0xF0) == 0xC0)
+        {
+            bankProgram = mevt->data[1] & 0x7F;
+            baseRowsStale = true;
+            params.markChanged();
+        }
+    }
+
+    bool nextTuningChange(uint32_t upTo, uint32_t &at)
+    {
+        int step;
+        if (sequence.next(upTo, at, step))
+        {
+            activeStep = step;
+            setActiveRows();
+            return true;
+        }
+
+        if (baseRowsStale)
+        {
+            baseRowsStale = false;
+            selectBaseRows();
+            setActiveRows();
+            at = upTo;
+            return true;
+        }
+        return false;
+    }
 
     clap_process_status process(const clap_process *process) noexcept override
     {
+        TNC_REALTIME_SCOPE();
+        TNC_TRACE_SCOPE(trace.process, "process");
+        if (internalTables.consume())
+            baseRowsStale = true;
+        if (layoutTables.consume())
+            baseRowsStale = true;
+        if (channelTables.consume())
+            takeChannelRows();
+        if (sequenceTables.consume())
+            baseRowsStale = true;
+        if (presetTables.consume())
+        {
+            presetLoaded = presetTables.read().loaded;
+            presetTuning = presetTables.read().retune;
+            baseRowsStale = true;
+        }
+        if (consumeBank())
+            _host.requestCallback();
+
+        // The rows of a table we just handed back may be rewritten from now on, so nothing
+        // reads them again, even while the loaded parameters are applied
+        if (baseRowsStale)
+        {
+            baseRowsStale = false;
+            selectBaseRows();
+            setActiveRows();
+        }
+        sequence.schedule(process->transport, process->frames_count, sampleRate);
         processTuningCore(this, process);
+        requestTableRefresh();
+
+        if (mtsMasterRegistered &&
+            (mtsRepublish.exchange(false) || publishedGeneration != rebuildCount))
+        {
+            TNC_TRACE_SCOPE(trace.process, "MTS master publish");
+            publishedGeneration = rebuildCount;
+            publishMtsTables();
+
+            publishedStep = activeStep;
+            publishedProgram = bankProgram;
+            mtsNameChanged = true;
+            _host.requestCallback();
+        }
         return CLAP_PROCESS_CONTINUE;
     }
 
-    void rebuildTuning()
-    {
-        if (frequency == priorFrequency && span == priorSpan && divisions == priorDivisions &&
-            center == priorCenter)
-            return;
+    uint64_t rebuildCount{0};
 
-        priorFrequency = scaleTuningFrequency;
-        priorSpan = span;
-        priorDivisions = divisions;
-        priorCenter = scaleTuningCenter;
-        auto sc = Tunings::evenDivisionOfSpanByM(span, divisions);
-        auto km = Tunings::tuneNoteTo(scaleTuningCenter, scaleTuningFrequency);
-        tuning = Tunings::Tuning(sc, km);
+    static void fillRetuning(const Tunings::Tuning &t, std::array<double, 128> &into)
+    {
         auto ed212 = Tunings::Tuning();
 
         for (int k = 0; k < 128; ++k)
         {
-            auto mt = tuning.logScaledFrequencyForMidiNote(k);
+            auto mt = t.logScaledFrequencyForMidiNote(k);
             auto et = ed212.logScaledFrequencyForMidiNote(k);
             auto diff = mt - et;
-            internalTuning[k] = diff * 12.0;
+            into[k] = diff * 12.0;
         }
     }
     void handleParamValue(const clap_event_param_value *pevt)
     {
         auto id = pevt->param_id;
         auto nf = pevt->value;
+
+        int step, which;
+        if (sequenceParam(id, step, which))
+        {
+            auto &s = sequence.steps[step];
+            switch (which)
+            {
+            case step_length:
+                // Only the block schedule depends on the length, so no table to rebuild
+                s.length = std::clamp(nf, 0., 64.);
+                return;
+            case step_span:
+                s.span = std::clamp(static_cast<int>(std::round(nf)), 2, 6);
+                break;
+            case step_divisions:
+                s.divisions = std::clamp(static_cast<int>(std::round(nf)), 3, 72);
+                break;
+            case step_center:
+                s.center = std::clamp(static_cast<int>(std::round(nf)), 0, 127);
+                break;
+            case step_frequency:
+                s.frequency = std::clamp(nf, 220.0, 880.0);
+                break;
+            }
+            stepsMoved = true;
+            return;
+        }
+
+        int ch;
+        if (channelParam(id, ch, which))
+        {
+            auto &cs = channelSettings[ch];
+            switch (which)
+            {
+            case channel_span:
+                cs.span = std::clamp(static_cast<int>(std::round(nf)), 2, 6);
+                break;
+            case channel_divisions:
+                cs.divisions = std::clamp(static_cast<int>(std::round(nf)), 3, 72);
+                break;
+            case channel_center:
+                cs.center = std::clamp(static_cast<int>(std::round(nf)), 0, 127);
+                break;
+            case channel_frequency:
+                cs.frequency = std::clamp(nf, 220.0, 880.0);
+                break;
+            }
+            channelsMoved = true;
+            return;
+        }
+
+        int port;
+        if (portChannelParam(id, port))
+        {
+            portTuningChannel[port] = std::clamp(static_cast<int>(std::round(nf)), 0, 16);
+            // The rows are unchanged, but held notes on the port now read another one
+            baseRowsStale = true;
+            return;
+        }
+
         switch (id)
         {
         case paramIdBase + octave_span:
         {
             span = std::clamp(static_cast<int>(std::round(nf)), 2, 6);
-            rebuildTuning();
+            baseMoved = true;
         }
         break;
         case paramIdBase + octave_divisions:
         {
             divisions = std::clamp(static_cast<int>(std::round(nf)), 3, 72);
-            rebuildTuning();
+            baseMoved = true;
         }
         break;
         case paramIdBase + center:
         {
             scaleTuningCenter = std::clamp(static_cast<int>(std::round(nf)), 0, 127);
-            rebuildTuning();
+            baseMoved = true;
         }
         break;
         case paramIdBase + frequency:
         {
             scaleTuningFrequency = std::clamp(nf, 220.0, 880.0);
-            rebuildTuning();
+            baseMoved = true;
         }
         break;
         case paramIdBase + release:
         {
             postNoteRelease = std::clamp(nf, 0., 100.);
-            rebuildTuning();
+        }
+        break;
+        case paramIdBase + snap_mode:
+        {
+            snap.active = nf > 0.5;
+        }
+        break;
+        case paramIdBase + snap_strength:
+        {
+            snap.strength = std::clamp(nf, 0., 1.);
+        }
+        break;
+        case paramIdBase + snap_hysteresis:
+        {
+            snap.hysteresis = std::clamp(nf, 0., 50.) / 100.0;
+        }
+        break;
+        case paramIdBase + note_ports:
+        {
+            requestedNotePorts = std::clamp(static_cast<int>(std::round(nf)), 1, maxNotePorts);
+            _host.requestCallback();
+        }
+        break;
+        case paramIdBase + sequence_mode:
+        {
+            sequence.active = nf > 0.5;
+        }
+        break;
+        case paramIdBase + mts_master:
+        {
+            mtsMasterRequested = nf > 0.5;
+            _host.requestCallback();
+        }
+        break;
+        case paramIdBase + key_layout:
+        {
+            requestedLayout = std::clamp(static_cast<int>(std::round(nf)), 0, maxKeyLayouts);
+            _host.requestCallback();
+        }
+        break;
+        case paramIdBase + tuning_bank:
+        {
+            requestedBank = std::clamp(static_cast<int>(std::round(nf)), 0, maxTuningBanks);
+            _host.requestCallback();
+        }
+        break;
+        case paramIdBase + bank_program:
+        {
+            bankProgram = std::clamp(static_cast<int>(std::round(nf)), 0, 127);
+            baseRowsStale = true;
+        }
+        break;
+        case paramIdBase + channel_tuning:
+        {
+            channelMode = nf > 0.5;
+            baseRowsStale = true;
+        }
+        break;
+        case paramIdBase + scala_preset:
+        {
+            scalaPreset = nf > 0.5;
+            baseRowsStale = true;
         }
         break;
         }
@@ -341,7 +1629,9 @@ struct EDMNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
 
     void paramsFlush(const clap_input_events *in, const clap_output_events *out) noexcept override
     {
+        TNC_REALTIME_SCOPE();
         paramsFlushTuningCore(this, in, out);
+        requestTableRefresh();
     }
 
     bool retuneHeldNotes() { return true; }
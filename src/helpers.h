@@ -20,11 +20,20 @@
 #include <sstream>
 #include <iomanip>
 #include <clocale>
+#include <cmath>
 
 #include <map>
 #include <string>
 #include <vector>
 
+#include "note_ports.h"
+#include "capture.h"
+#include "param_snapshot.h"
+#include "release_wheel.h"
+#include "rt_checks.h"
+#include "scale_snap.h"
+#include "trace.h"
+
 inline bool helpersStateSave(const clap_ostream *stream,
                              const std::map<clap_id, double> &paramToValue) noexcept
 {
@@ -109,61 +118,200 @@ inline bool helpersStateLoad(const clap_istream *stream,
     return true;
 }
 
+// A session saved before a parameter existed loads it at its default rather than leaving the
+// live value in place
+template <typename T> inline void fillParamDefaults(const T *that, std::map<clap_id, double> &vals)
+{
+    for (uint32_t i = 0; i < that->paramsCount(); ++i)
+    {
+        auto info = clap_param_info();
+        if (that->paramsInfo(i, &info))
+            vals.emplace(info.id, info.default_value);
+    }
+}
+
+// Loaded state reaches the plugin through handleParamValue, like any change from the host
+template <typename T> inline bool applyLoadedParams(T *that)
+{
+    return that->params.applyLoaded([that](clap_id index, double value) {
+        auto pevt = clap_event_param_value();
+        pevt.header.size = sizeof(clap_event_param_value);
+        pevt.header.type = (uint16_t)CLAP_EVENT_PARAM_VALUE;
+        pevt.header.time = 0;
+        pevt.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        pevt.header.flags = 0;
+        pevt.param_id = T::paramIdBase + index;
+        pevt.cookie = nullptr;
+        pevt.note_id = -1;
+        pevt.port_index = -1;
+        pevt.channel = -1;
+        pevt.key = -1;
+        pevt.value = value;
+        that->handleParamValue(&pevt);
+    });
+}
+
+template <typename T>
+inline void publishParams(T *that, const clap_output_events *out, uint32_t time)
+{
+    that->params.publish(
+        [that](clap_id index) { return that->liveParamValue(T::paramIdBase + index); }, out,
+        T::paramIdBase, time);
+}
+
 template <typename T> inline void processTuningCore(T *that, const clap_process *process)
 {
+    TNC_CAPTURE_PROCESS(that->capture, process);
     auto ev = process->in_events;
     auto ov = process->out_events;
     auto sz = ev->size(ev);
 
     auto &sclTuning = that->sclTuning;
-    // Generate top-of-block tuning messages for all our notes that are on
-    for (int c = 0; c < 16; ++c)
-    {
-        for (int i = 0; i < 128; ++i)
+    auto &expressionTuning = that->expressionTuning;
+    auto notePorts = that->notePorts;
+    auto &noteState = that->noteState;
+
+    // Stop tracking every note whose release ended at or before this sample of the block
+    auto expireReleases = [&](uint32_t time) {
+        that->releases.advance(that->sampleClock + time, [&noteState](uint32_t v) {
+            noteState[v / (16 * 128)][(v / 128) % 16][v % 128] = NOTE_OFF;
+        });
+    };
+    expireReleases(0);
+
+    /*
+     * sclTuning caches the retuning of every sounding note. It is filled at note on and only
+     * refreshed here, when the tuning generation moves, so inbound expressions never have to
+     * go back to the tuning source.
+     */
+    auto retuneSounding = [&](uint32_t time) {
+        auto generation = that->tuningGeneration();
+        if (!that->tuningActive() || !that->retuneHeldNotes() ||
+            generation == that->retunedGeneration)
+            return;
+
+        that->retunedGeneration = generation;
+        int retuned = 0;
+
+        // A release which ended earlier in this block gets no more expressions
+        expireReleases(time);
+
+        auto retuneVoice = [&](uint32_t p, int c, int i, int tc) {
+            if (noteState[p][c][i] == NOTE_OFF || noteState[p][c][i] == NOTE_DROPPED)
+                return;
+
+            auto prior = sclTuning[p][c][i];
+            sclTuning[p][c][i] = that->retuningFor(i, tc);
+            if (sclTuning[p][c][i] == prior)
+                return;
+
+            auto q = clap_event_note_expression();
+            q.header.size = sizeof(clap_event_note_expression);
+            q.header.type = (uint16_t)CLAP_EVENT_NOTE_EXPRESSION;
+            q.header.time = time;
+            q.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+            q.header.flags = 0;
+            q.key = i;
+            q.channel = c;
+            q.port_index = p;
+            q.expression_id = CLAP_NOTE_EXPRESSION_TUNING;
+
+            q.value = sclTuning[p][c][i] + expressionTuning[p][c][i];
+            if (that->snap.active && expressionTuning[p][c][i] != 0.0)
+                q.value = that->snap.apply(p, c, i, tc, q.value);
+
+            ov->try_push(ov, reinterpret_cast<const clap_event_header *>(&q));
+            retuned++;
+        };
+
+        // A source which knows which keys it moved names them, so the sweep costs what it
+        // holds rather than every key; otherwise go over all our notes in one pass
+        int keyCount = 0;
+        auto keys = that->retunedKeys(keyCount);
+        for (uint32_t p = 0; p < notePorts; ++p)
         {
-            if (that->tuningActive() && that->noteRemaining[c][i] != 0.f && that->retuneHeldNotes())
+            for (int c = 0; c < 16; ++c)
             {
-                auto prior = sclTuning[c][i];
-                sclTuning[c][i] = that->retuningFor(i, c);
-                if (sclTuning[c][i] != prior)
-                {
-                    auto q = clap_event_note_expression();
-                    q.header.size = sizeof(clap_event_note_expression);
-                    q.header.type = (uint16_t)CLAP_EVENT_NOTE_EXPRESSION;
-                    q.header.time = 0;
-                    q.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
-                    q.header.flags = 0;
-                    q.key = i;
-                    q.channel = c;
-                    q.port_index = 0;
-                    q.expression_id = CLAP_NOTE_EXPRESSION_TUNING;
-
-                    q.value = sclTuning[c][i];
-
-                    ov->try_push(ov, reinterpret_cast<const clap_event_header *>(&q));
-                }
+                auto tc = that->tuningChannel(p, c);
+                if (keys)
+                    for (int k = 0; k < keyCount; ++k)
+                        retuneVoice(p, c, keys[k], tc);
+                else
+                    for (int i = 0; i < 128; ++i)
+                        retuneVoice(p, c, i, tc);
             }
         }
-    }
+        TNC_TRACE_COUNTER(that->trace.process, "retuned notes", retuned);
+    };
+
+    // Tuning changes the plugin scheduled inside this block (at sample offsets up to and
+    // including upTo) retune the sounding notes at exactly that sample
+    auto applyScheduledTuning = [&](uint32_t upTo) {
+        uint32_t at;
+        while (that->nextTuningChange(upTo, at))
+            retuneSounding(at);
+    };
+
+    TNC_CAPTURE_LOAD_APPLIED(applyLoadedParams(that));
+    applyScheduledTuning(0);
+    retuneSounding(0);
 
     for (uint32_t i = 0; i < sz; ++i)
     {
         auto evt = ev->get(ev, i);
+        applyScheduledTuning(evt->time);
         switch (evt->type)
         {
         case CLAP_EVENT_PARAM_VALUE:
         {
             auto pevt = reinterpret_cast<const clap_event_param_value *>(evt);
 
+            that->params.hostSent(pevt->param_id - T::paramIdBase, pevt->value);
             that->handleParamValue(pevt);
+            applyScheduledTuning(evt->time);
         }
         break;
         case CLAP_EVENT_MIDI:
+        {
+            that->handleMidi(reinterpret_cast<const clap_event_midi *>(evt));
+            ov->try_push(ov, evt);
+            applyScheduledTuning(evt->time);
+        }
+        break;
         case CLAP_EVENT_MIDI2:
         case CLAP_EVENT_MIDI_SYSEX:
-        case CLAP_EVENT_NOTE_CHOKE:
             ov->try_push(ov, evt);
             break;
+        case CLAP_EVENT_NOTE_CHOKE:
+        {
+            auto nevt = reinterpret_cast<const clap_event_note *>(evt);
+
+            // A -1 port, channel or key chokes every voice it matches, so each of them stops
+            // being tracked here too and the tuning source hears about each held one
+            uint32_t p0 = nevt->port_index < 0 ? 0 : notePortFor(nevt->port_index, notePorts);
+            uint32_t p1 = nevt->port_index < 0 ? notePorts : p0 + 1;
+            int c0 = nevt->channel < 0 ? 0 : nevt->channel;
+            int c1 = nevt->channel < 0 ? 16 : nevt->channel + 1;
+            int k0 = nevt->key < 0 ? 0 : nevt->key;
+            int k1 = nevt->key < 0 ? 128 : nevt->key + 1;
+            bool choked = false;
+            for (uint32_t p = p0; p < p1; ++p)
+                for (int c = c0; c < c1; ++c)
+                    for (int k = k0; k < k1; ++k)
+                    {
+                        if (noteState[p][c][k] == NOTE_OFF)
+                            continue;
+                        if (noteState[p][c][k] == NOTE_HELD)
+                            that->heldNoteOff(k);
+                        noteState[p][c][k] = NOTE_OFF;
+                        that->releases.cancel(voiceIndex(p, c, k));
+                        choked = true;
+                    }
+            if (choked)
+                applyScheduledTuning(nevt->header.time);
+            ov->try_push(ov, evt);
+        }
+        break;
         case CLAP_EVENT_NOTE_ON:
         {
             auto nevt = reinterpret_cast<const clap_event_note *>(evt);
@@ -171,7 +319,24 @@ template <typename T> inline void processTuningCore(T *that, const clap_process
             assert(nevt->channel < 16);
             assert(nevt->key >= 0);
             assert(nevt->key < 128);
-            that->noteRemaining[nevt->channel][nevt->key] = -1;
+            auto p = notePortFor(nevt->port_index, notePorts);
+
+            // A key the tuning source leaves unmapped never reaches the synth. A retrigger of a
+            // note we already passed on still goes through, so its note off isn't lost.
+            if (noteState[p][nevt->channel][nevt->key] != NOTE_HELD &&
+                that->noteFiltered(p, nevt->channel, nevt->key))
+            {
+                noteState[p][nevt->channel][nevt->key] = NOTE_DROPPED;
+                that->releases.cancel(voiceIndex(p, nevt->channel, nevt->key));
+                break;
+            }
+
+            if (noteState[p][nevt->channel][nevt->key] != NOTE_HELD)
+                that->heldNoteOn(nevt->key);
+            noteState[p][nevt->channel][nevt->key] = NOTE_HELD;
+            that->releases.cancel(voiceIndex(p, nevt->channel, nevt->key));
+            expressionTuning[p][nevt->channel][nevt->key] = 0.0;
+            that->snap.resetNote(p, nevt->channel, nevt->key);
 
             auto q = clap_event_note_expression();
             q.header.size = sizeof(clap_event_note_expression);
@@ -187,12 +352,16 @@ template <typename T> inline void processTuningCore(T *that, const clap_process
 
             if (that->tuningActive())
             {
-                sclTuning[nevt->channel][nevt->key] = that->retuningFor(nevt->key, nevt->channel);
+                sclTuning[p][nevt->channel][nevt->key] =
+                    that->retuningFor(nevt->key, that->tuningChannel(p, nevt->channel));
             }
-            q.value = sclTuning[nevt->channel][nevt->key];
+            q.value = sclTuning[p][nevt->channel][nevt->key];
 
             ov->try_push(ov, evt);
             ov->try_push(ov, &(q.header));
+
+            // A source which tunes from the held notes may want the others to move now
+            applyScheduledTuning(nevt->header.time);
         }
         break;
         case CLAP_EVENT_NOTE_OFF:
@@ -202,26 +371,64 @@ template <typename T> inline void processTuningCore(T *that, const clap_process
             assert(nevt->channel < 16);
             assert(nevt->key >= 0);
             assert(nevt->key < 128);
-            that->noteRemaining[nevt->channel][nevt->key] = that->postNoteRelease;
+            auto p = notePortFor(nevt->port_index, notePorts);
+            if (noteState[p][nevt->channel][nevt->key] == NOTE_DROPPED)
+            {
+                noteState[p][nevt->channel][nevt->key] = NOTE_OFF;
+                break;
+            }
+            if (noteState[p][nevt->channel][nevt->key] == NOTE_HELD)
+                that->heldNoteOff(nevt->key);
+            auto releaseSamples = (uint64_t)std::llround(that->postNoteRelease * that->sampleRate);
+            if (releaseSamples == 0)
+            {
+                noteState[p][nevt->channel][nevt->key] = NOTE_OFF;
+                that->releases.cancel(voiceIndex(p, nevt->channel, nevt->key));
+            }
+            else
+            {
+                noteState[p][nevt->channel][nevt->key] = NOTE_RELEASING;
+                that->releases.schedule(voiceIndex(p, nevt->channel, nevt->key),
+                                        that->sampleClock + nevt->header.time + releaseSamples);
+            }
             ov->try_push(ov, evt);
+            applyScheduledTuning(nevt->header.time);
         }
         break;
         case CLAP_EVENT_NOTE_EXPRESSION:
         {
             auto nevt = reinterpret_cast<const clap_event_note_expression *>(evt);
 
-            auto oevt = clap_event_note_expression();
-            memcpy(&oevt, evt, nevt->header.size);
+            if (nevt->key >= 0 && nevt->channel >= 0 &&
+                noteState[notePortFor(nevt->port_index, notePorts)][nevt->channel][nevt->key] ==
+                    NOTE_DROPPED)
+                break;
+
+            // Nothing about other expressions (or wildcard tuning ones) changes, so send them
+            // along untouched
+            if (nevt->expression_id != CLAP_NOTE_EXPRESSION_TUNING || nevt->key < 0 ||
+                nevt->channel < 0)
+            {
+                ov->try_push(ov, evt);
+                break;
+            }
 
-            if (nevt->expression_id == CLAP_NOTE_EXPRESSION_TUNING)
+            auto p = notePortFor(nevt->port_index, notePorts);
+            auto c = nevt->channel;
+            auto k = nevt->key;
+            if (noteState[p][c][k] == NOTE_OFF && that->tuningActive())
             {
-                if (that->tuningActive())
-                {
-                    sclTuning[nevt->channel][nevt->key] =
-                        that->retuningFor(nevt->key, nevt->channel);
-                }
-                oevt.value += sclTuning[nevt->channel][nevt->key];
+                // An expression for a note we never saw start, so nothing is cached
+                sclTuning[p][c][k] = that->retuningFor(k, that->tuningChannel(p, c));
             }
+            expressionTuning[p][c][k] = nevt->value;
+
+            auto oevt = *nevt;
+            oevt.header.size = sizeof(clap_event_note_expression);
+            oevt.value += sclTuning[p][c][k];
+
+            if (that->snap.active)
+                oevt.value = that->snap.apply(p, c, k, that->tuningChannel(p, c), oevt.value);
 
             ov->try_push(ov, &oevt.header);
         }
@@ -229,21 +436,20 @@ template <typename T> inline void processTuningCore(T *that, const clap_process
         }
     }
 
-    // subtract block size seconds from everyone with remaining time and zero out some
-    for (auto &c : that->noteRemaining)
-        for (auto &n : c)
-            if (n > 0.f)
-            {
-                n -= that->secondsPerSample * process->frames_count;
-                if (n < 0)
-                    n = 0.f;
-            }
+    if (process->frames_count > 0)
+        applyScheduledTuning(process->frames_count - 1);
+
+    publishParams(that, ov, process->frames_count > 0 ? process->frames_count - 1 : 0);
+    that->sampleClock += process->frames_count;
 }
 
 template <typename T>
 void paramsFlushTuningCore(T *that, const clap_input_events *in,
                            const clap_output_events *out) noexcept
 {
+    TNC_CAPTURE_FLUSH(that->capture, in, out);
+    TNC_CAPTURE_LOAD_APPLIED(applyLoadedParams(that));
+
     auto ev = in;
     auto sz = in->size(in);
     for (uint32_t i = 0; i < sz; ++i)
@@ -255,9 +461,11 @@ void paramsFlushTuningCore(T *that, const clap_input_events *in,
         {
             auto pevt = reinterpret_cast<const clap_event_param_value *>(evt);
 
+            that->params.hostSent(pevt->param_id - T::paramIdBase, pevt->value);
             that->handleParamValue(pevt);
         }
         }
     }
+    publishParams(that, out, 0);
 }
 #endif // TUNING_NOTE_CLAPS_HELPERS_H
@@ -0,0 +1,122 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_KEY_LAYOUT_H
+#define TUNING_NOTE_CLAPS_KEY_LAYOUT_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+/*
+ * Our files live in ~/Documents/tuning-note-claps (or the Windows equivalent). We stick to
+ * strings rather than std::filesystem since the mac build still targets 10.11.
+ */
+inline std::string userDataDirectory()
+{
+#if defined(_WIN32)
+    auto home = std::getenv("USERPROFILE");
+#else
+    auto home = std::getenv("HOME");
+#endif
+    if (!home)
+        return {};
+    return std::string(home) + "/Documents/tuning-note-claps";
+}
+
+/*
+ * A KeyLayout maps each (channel, key) an isomorphic controller sends to a scale degree, so
+ * a board which uses channel as a block selector can reach thousands of pitches. Degree d
+ * sounds the pitch key d would have in the unbounded EDN-M scale, so keys the layout does
+ * not mention keep their usual degree.
+ *
+ * Layout files are plain text with one "channel key degree" triple per line, channels
+ * counting from 1 and '#' starting a comment.
+ */
+struct KeyLayout
+{
+    std::array<std::array<int32_t, 128>, 16> degrees;
+
+    KeyLayout() { clear(); }
+
+    void clear()
+    {
+        for (auto &c : degrees)
+            for (int k = 0; k < 128; ++k)
+                c[k] = k;
+    }
+
+    static std::string pathFor(int index)
+    {
+        return userDataDirectory() + "/layouts/layout-" + std::to_string(index) + ".txt";
+    }
+
+    bool load(const std::string &path)
+    {
+        clear();
+
+        std::ifstream ifs(path);
+        if (!ifs.is_open())
+            return false;
+
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            auto hash = line.find('#');
+            if (hash != std::string::npos)
+                line.resize(hash);
+
+            int channel, key, degree;
+            if (sscanf(line.c_str(), "%d %d %d", &channel, &key, &degree) != 3)
+                continue;
+            if (channel < 1 || channel > 16 || key < 0 || key > 127)
+                continue;
+            degrees[channel - 1][key] = degree;
+        }
+        return true;
+    }
+};
+
+/*
+ * The finished lookup for the audio thread: the retuning in semitones from 12-TET of every
+ * (channel, key), so retuningFor is one indexed load.
+ */
+struct KeyLayoutTable
+{
+    bool active{false};
+    std::array<std::array<double, 128>, 16> retune;
+
+    // The EDN-M with 'divisions' steps per 'span', where key 'center' sounds at 'frequency'
+    void build(const KeyLayout &layout, int span, int divisions, int center, double frequency)
+    {
+        auto step = 12.0 * std::log2((double)span) / divisions;
+        auto centerPitch = 69.0 + 12.0 * std::log2(frequency / 440.0);
+
+        for (int c = 0; c < 16; ++c)
+        {
+            for (int k = 0; k < 128; ++k)
+            {
+                auto pitch = centerPitch + (layout.degrees[c][k] - center) * step;
+                // The widest retuning a tuning note expression can carry
+                retune[c][k] = std::clamp(pitch - k, -120.0, 120.0);
+            }
+        }
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_KEY_LAYOUT_H
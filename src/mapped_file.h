@@ -0,0 +1,110 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_MAPPED_FILE_H
+#define TUNING_NOTE_CLAPS_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped read only. Empty files don't map.
+struct MappedFile
+{
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap((void *)data, size);
+#endif
+    }
+
+    const uint8_t *data{nullptr};
+    size_t size{0};
+
+    bool map(const std::string &path)
+    {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER sz;
+        if (!GetFileSizeEx(file, &sz) || sz.QuadPart == 0)
+            return false;
+        size = (size_t)sz.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            return false;
+        data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return data != nullptr;
+#else
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        data = (const uint8_t *)p;
+        return true;
+#endif
+    }
+
+    // Bring every page in now, so whoever reads the mapping later doesn't fault on it
+    void prefault() const
+    {
+#if !defined(_WIN32)
+        madvise((void *)data, size, MADV_WILLNEED);
+#endif
+        volatile uint8_t sink = 0;
+        for (size_t i = 0; i < size; i += 4096)
+            sink = sink + data[i];
+    }
+
+  private:
+#if defined(_WIN32)
+    HANDLE file{INVALID_HANDLE_VALUE}, mapping{nullptr};
+#endif
+};
+
+#endif // TUNING_NOTE_CLAPS_MAPPED_FILE_H
@@ -23,6 +23,8 @@
 #include <iostream>
 #include <iomanip>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cmath>
 
 #include "helpers.h"
@@ -38,13 +40,9 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
         : clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
                                 clap::helpers::CheckingLevel::Minimal>(desc, host)
     {
-        for (auto &c : noteRemaining)
-            for (auto &n : c)
-                n = 0.f;
-
-        for (auto &c : sclTuning)
-            for (auto &f : c)
-                f = 0.f;
+        sizeNoteStateCore(this);
+        portTuningChannel.fill(0);
+        publishParams(this, nullptr, 0);
     }
 
     ~MTSNE()
@@ -56,8 +54,9 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
         }
     }
 
-    MTSClient *mtsClient{nullptr};
-    double secondsPerSample{0.f};
+    // Only the main thread registers; process() asks it to when the client is missing
+    std::atomic<MTSClient *> mtsClient{nullptr};
+    double sampleRate{0};
 
     double postNoteRelease{2.0};
     int dummyMtsValue{0};
@@ -75,50 +74,70 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
                 strncpy(priorScaleName, MTS_GetScaleName(mtsClient), CLAP_NAME_SIZE);
         }
 
-        secondsPerSample = 1.0 / sampleRate;
+        this->sampleRate = sampleRate;
+        TNC_CAPTURE_ACTIVATE(capture, clapPlugin(), sampleRate, minFrameCount, maxFrameCount);
         return true;
     }
 
     void deactivate() noexcept override
     {
+        TNC_CAPTURE_DEACTIVATE(capture);
         if (mtsClient)
         {
             MTS_DeregisterClient(mtsClient);
             mtsClient = nullptr;
         }
+        if (requestedNotePorts != notePorts)
+            _host.requestCallback();
     }
 
     bool implementsNotePorts() const noexcept override { return true; }
-    uint32_t notePortsCount(bool isInput) const noexcept override { return 1; }
+    uint32_t notePortsCount(bool isInput) const noexcept override { return notePorts; }
     bool notePortsInfo(uint32_t index, bool isInput,
                        clap_note_port_info *info) const noexcept override
     {
-        info->id = 1 + (isInput ? 1 : 0);
-        info->supported_dialects = CLAP_NOTE_DIALECT_CLAP | CLAP_NOTE_DIALECT_MIDI |
-                                   CLAP_NOTE_DIALECT_MIDI_MPE | CLAP_NOTE_DIALECT_MIDI2;
-        info->preferred_dialect = CLAP_NOTE_DIALECT_CLAP;
-        if (isInput)
-        {
-            strncpy(info->name, "MTS Note Input", CLAP_NAME_SIZE);
-        }
-        else
-        {
-            strncpy(info->name, "MTS Note Output", CLAP_NAME_SIZE);
-        }
-        return true;
+        return notePortsInfoCore(index, isInput, "MTS", info);
+    }
+
+    uint32_t notePorts{1};
+    std::atomic<uint32_t> requestedNotePorts{1};
+
+    // 0 looks up the MTS tuning on the note's own channel, 1-16 forces a channel for the port
+    std::array<int, maxNotePorts> portTuningChannel;
+    static constexpr int portChannelParamBase = 7;
+    static constexpr int filterNotesParam = portChannelParamBase + maxNotePorts;
+    static constexpr int paramCount = filterNotesParam + 1;
+
+    bool portChannelParam(clap_id paramId) const
+    {
+        return paramId >= paramIdBase + portChannelParamBase &&
+               paramId < paramIdBase + filterNotesParam;
     }
 
     static constexpr int paramIdBase = 54082;
     bool implementsParams() const noexcept override { return true; }
     bool isValidParamId(clap_id paramId) const noexcept override
     {
-        return paramId >= paramIdBase && paramId <= paramIdBase + paramsCount();
+        return paramId >= paramIdBase && paramId < paramIdBase + paramsCount();
     }
-    uint32_t paramsCount() const noexcept override { return 3; }
+    uint32_t paramsCount() const noexcept override { return paramCount; }
     bool paramsInfo(uint32_t paramIndex, clap_param_info *info) const noexcept override
     {
         info->id = paramIndex + paramIdBase;
 
+        if (portChannelParam(info->id))
+        {
+            auto nm = "Port " + std::to_string(paramIndex - portChannelParamBase + 1) +
+                      " Tuning Channel";
+            strncpy(info->name, nm.c_str(), CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 16;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            return true;
+        }
+
         switch (paramIndex)
         {
         case 0:
@@ -148,6 +167,46 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             info->default_value = 1;
             info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
             break;
+        case 3:
+            strncpy(info->name, "Snap Expressions To Scale", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
+        case 4:
+            strncpy(info->name, "Snap Strength", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 1;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case 5:
+            strncpy(info->name, "Snap Hysteresis (cents)", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 50;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE;
+            break;
+        case 6:
+            strncpy(info->name, "Note Ports", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 1;
+            info->max_value = maxNotePorts;
+            info->default_value = 1;
+            info->flags = CLAP_PARAM_IS_STEPPED;
+            break;
+        case filterNotesParam:
+            strncpy(info->name, "Filter Unmapped Notes", CLAP_NAME_SIZE);
+            strncpy(info->module, "", CLAP_NAME_SIZE);
+            info->min_value = 0;
+            info->max_value = 1;
+            info->default_value = 0;
+            info->flags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+            break;
         default:
             return false;
         }
@@ -156,19 +215,38 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
     }
     bool paramsValue(clap_id paramId, double *value) noexcept override
     {
+        if (!isValidParamId(paramId))
+            return false;
+        *value = params.values()[paramId - paramIdBase];
+        return true;
+    }
+
+    // The audio thread's view, which publishParams copies into the snapshot
+    double liveParamValue(clap_id paramId) const
+    {
+        if (portChannelParam(paramId))
+            return portTuningChannel[paramId - paramIdBase - portChannelParamBase];
+
         switch (paramId)
         {
         case paramIdBase + 0:
-            *value = dummyMtsValue;
-            break;
+            return dummyMtsValue;
         case paramIdBase + 1:
-            *value = postNoteRelease;
-            break;
+            return postNoteRelease;
         case paramIdBase + 2:
-            *value = retuneHeld ? 1 : 0;
-            break;
+            return retuneHeld ? 1 : 0;
+        case paramIdBase + 3:
+            return snap.active ? 1 : 0;
+        case paramIdBase + 4:
+            return snap.strength;
+        case paramIdBase + 5:
+            return snap.hysteresis * 100.0;
+        case paramIdBase + 6:
+            return requestedNotePorts;
+        case paramIdBase + filterNotesParam:
+            return filterNotes ? 1 : 0;
         }
-        return true;
+        return 0;
     }
 
     static constexpr const char *disconLabel = "No MTS Connection";
@@ -176,6 +254,15 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
                            uint32_t size) noexcept override
     {
         memset(display, 0, size * sizeof(char));
+        if (portChannelParam(paramId))
+        {
+            if (value < 0.5)
+                strncpy(display, "Note Channel", size - 1);
+            else
+                strncpy(display, ("Channel " + std::to_string((int)value)).c_str(), size - 1);
+            return true;
+        }
+
         switch (paramId)
         {
         case paramIdBase + 0:
@@ -207,12 +294,55 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
                 strncpy(display, "Snap at Note On", size - 1);
             return true;
         }
+        case paramIdBase + 3:
+        {
+            if (value)
+                strncpy(display, "Snap To Scale", size - 1);
+            else
+                strncpy(display, "Off", size - 1);
+            return true;
+        }
+        case paramIdBase + filterNotesParam:
+        {
+            if (value > 0.5)
+                strncpy(display, "Drop Unmapped", size - 1);
+            else
+                strncpy(display, "Off", size - 1);
+            return true;
+        }
+        case paramIdBase + 4:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(3) << value * 100.0 << " %";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + 5:
+        {
+            std::ostringstream oss;
+            oss << std::setprecision(3) << value << " cents";
+            strncpy(display, oss.str().c_str(), size - 1);
+            return true;
+        }
+        case paramIdBase + 6:
+        {
+            strncpy(display, std::to_string((int)value).c_str(), size - 1);
+            return true;
+        }
         }
         return false;
     }
 
     bool paramsTextToValue(clap_id paramId, const char *display, double *value) noexcept override
     {
+        if (portChannelParam(paramId))
+        {
+            if (strncmp(display, "Channel ", 8) == 0)
+                display += 8;
+            *value = std::atoi(display);
+            return true;
+        }
+
         switch (paramId)
         {
         case paramIdBase + 0:
@@ -221,21 +351,151 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             return true;
         }
         case paramIdBase + 1:
+        case paramIdBase + 5:
         {
             *value = std::atof(display);
             return true;
         }
+        case paramIdBase + 3:
+        case paramIdBase + filterNotesParam:
+        {
+            *value = (strcmp(display, "Off") == 0) ? 0 : 1;
+            return true;
+        }
+        case paramIdBase + 4:
+        {
+            *value = std::atof(display) / 100.0;
+            return true;
+        }
+        case paramIdBase + 6:
+        {
+            *value = std::atoi(display);
+            return true;
+        }
         }
         return false;
     }
 
     char priorScaleName[CLAP_NAME_SIZE];
-    std::array<std::array<float, 128>, 16>
-        noteRemaining; // -1 means still held, otherwise its the time
-    std::array<std::array<double, 128>, 16> sclTuning;
+    TNC_TRACE_INSTANCE(trace, "MTSNE");
+    TNC_CAPTURE_INSTANCE(capture);
+    NoteArray<uint8_t> noteState;
+    ReleaseWheel releases; // deadlines of releasing notes, in samples
+    uint64_t sampleClock{0};
+    NoteArray<double> sclTuning;
+    NoteArray<double> expressionTuning; // the last inbound tuning expression per note
+    uint64_t retunedGeneration{0};
+
+    // MTS-ESP has no change notification, so each block is a fresh tuning snapshot
+    uint64_t blockCount{0};
+    uint64_t tuningGeneration() const { return blockCount; }
+
+    ScaleSnap snap;
+
+    /*
+     * With filtering on, keys the master marks as unmapped are dropped along with their
+     * expressions. MTS_ShouldFilterNote is read into a bit per tuning channel and key, so the
+     * note path tests one bit.
+     */
+    bool filterNotes{false};
+    bool filterActive{false}; // filterNotes with a master connected, for this block
+    std::array<std::bitset<128>, 16> filterMask;
+
+    /*
+     * While snapping or filtering is on, each block looks for a change in the master's tuning
+     * on every tuning channel our ports can reach: a new scale name, or a moved frequency on
+     * one of a few probe keys. Every fullRefreshBlocks blocks all 128 keys are read, which
+     * catches an edit the probes miss. Only a channel which moved has its filtered keys and
+     * snap table read again.
+     */
+    static constexpr uint32_t fullRefreshBlocks = 64;
+    static constexpr std::array<int, 8> probeKeys{0, 21, 48, 60, 69, 84, 108, 127};
+    std::array<std::array<double, 128>, 16> mtsFrequencies{};
+    std::array<std::array<double, 128>, 16> mtsRetuning{};
+    char tablesScaleName[CLAP_NAME_SIZE]{0};
+    uint32_t blocksSinceFullRefresh{0};
+    bool mtsTablesStale{true};
+
+    void refreshTuningTables()
+    {
+        std::bitset<16> used;
+        for (uint32_t p = 0; p < notePorts; ++p)
+        {
+            if (portTuningChannel[p])
+                used.set(portTuningChannel[p] - 1);
+            else
+                used.set();
+        }
+
+        auto name = MTS_GetScaleName(mtsClient);
+        auto forced = mtsTablesStale || strncmp(tablesScaleName, name, CLAP_NAME_SIZE) != 0;
+        auto full = forced || ++blocksSinceFullRefresh >= fullRefreshBlocks;
+        if (forced)
+            strncpy(tablesScaleName, name, CLAP_NAME_SIZE - 1);
+        if (full)
+            blocksSinceFullRefresh = 0;
+        mtsTablesStale = false;
+
+        ScaleSnap::Rows rows;
+        bool snapMoved = false;
+        for (int c = 0; c < 16; ++c)
+        {
+            rows[c] = mtsRetuning[c].data();
+            if (!used[c])
+                continue;
+
+            bool moved = forced;
+            for (int i = 0; i < (int)probeKeys.size() && !moved; ++i)
+            {
+                auto k = probeKeys[i];
+                moved = MTS_NoteToFrequency(mtsClient, (char)k, (char)c) != mtsFrequencies[c][k];
+            }
+            if (moved || full)
+            {
+                for (int k = 0; k < 128; ++k)
+                {
+                    auto f = MTS_NoteToFrequency(mtsClient, (char)k, (char)c);
+                    moved = moved || f != mtsFrequencies[c][k];
+                    mtsFrequencies[c][k] = f;
+                }
+            }
+            if (!moved)
+                continue;
+
+            if (filterActive)
+                for (int k = 0; k < 128; ++k)
+                    filterMask[c][k] = MTS_ShouldFilterNote(mtsClient, (char)k, (char)c);
+            if (!snap.active)
+                continue;
+
+            for (int k = 0; k < 128; ++k)
+                mtsRetuning[c][k] = retuningFor(k, c);
+            snapMoved = true;
+        }
+
+        if (snapMoved)
+        {
+            TNC_TRACE_SCOPE(trace.process, "snap rebuild");
+            snap.rebuild(rows);
+        }
+    }
+
+    const int16_t *retunedKeys(int &count) { return nullptr; }
+    bool noteFiltered(int port, int channel, int key) const
+    {
+        return filterActive && filterMask[tuningChannel(port, channel)][key];
+    }
+
+    ParamSnapshot<paramCount> params;
 
     void onMainThread() noexcept override
     {
+        if (!mtsClient && isActive())
+        {
+            TNC_TRACE_SCOPE(trace.main, "MTS reconnect");
+            mtsClient = MTS_RegisterClient();
+        }
+
         // Scale name has changed. We need to send events
         if (_host.canUseParams())
             _host.paramsRescan(CLAP_PARAM_RESCAN_TEXT);
@@ -243,39 +503,54 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             strncpy(priorScaleName, MTS_GetScaleName(mtsClient), CLAP_NAME_SIZE);
         else
             strncpy(priorScaleName, disconLabel, CLAP_NAME_SIZE);
+
+        updateNotePortsCore(this, _host, isActive());
     }
 
     bool implementsState() const noexcept override { return true; }
     bool stateSave(const clap_ostream *stream) noexcept override
     {
         std::map<clap_id, double> vals;
-        vals[paramIdBase + 1] = postNoteRelease;
-        vals[paramIdBase + 2] = retuneHeld;
+        const auto &v = params.values();
+        // The connection status isn't state
+        for (int i = 1; i < paramCount; ++i)
+            vals[paramIdBase + i] = v[i];
         return helpersStateSave(stream, vals);
     }
     bool stateLoad(const clap_istream *stream) noexcept override
     {
+        TNC_TRACE_SCOPE(trace.main, "stateLoad");
         std::map<clap_id, double> vals;
         auto res = helpersStateLoad(stream, vals);
         if (!res)
             return false;
 
-        postNoteRelease = vals[paramIdBase + 1];
-        retuneHeld = vals[paramIdBase + 1] != 0;
+        // The audio thread applies the values at its next block; with none running we do.
+        // Older sessions lack the later parameters, which then go back to their defaults.
+        fillParamDefaults(this, vals);
+        vals.erase(paramIdBase + 0);
+        params.post(vals, paramIdBase);
+        if (!isActive())
+        {
+            applyLoadedParams(this);
+            publishParams(this, nullptr, 0);
+            updateNotePortsCore(this, _host, isActive());
+        }
 
+        TNC_CAPTURE_STATE(capture, clapPlugin());
         return true;
     }
 
     clap_process_status process(const clap_process *process) noexcept override
     {
-        if (!mtsClient && ++reCheckMTS < 50)
+        TNC_REALTIME_SCOPE();
+        TNC_TRACE_SCOPE(trace.process, "process");
+        // Registering allocates, so a missing client is left to the main thread
+        if (!mtsClient && ++reCheckMTS >= 50)
         {
-            mtsClient = MTS_RegisterClient();
-            priorScaleName[0] = 0;
-            if (MTS_HasMaster(mtsClient))
-                strncpy(priorScaleName, MTS_GetScaleName(mtsClient), CLAP_NAME_SIZE);
-
+            TNC_TRACE_INSTANT(trace.process, "MTS reconnect", reCheckMTS);
             reCheckMTS = 0;
+            _host.requestCallback();
         }
 
         if (mtsClient && MTS_HasMaster(mtsClient) &&
@@ -290,6 +565,11 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
             _host.requestCallback();
         }
 
+        filterActive = filterNotes && tuningActive();
+        if ((snap.active || filterActive) && tuningActive())
+            refreshTuningTables();
+
+        blockCount++;
         processTuningCore(this, process);
 
         return CLAP_PROCESS_CONTINUE;
@@ -301,14 +581,54 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
         auto nf = pevt->value;
         if (id == paramIdBase + 1)
         {
-            postNoteRelease = nf;
+            postNoteRelease = std::clamp(nf, 0., 100.);
         }
         if (id == paramIdBase + 2)
         {
             retuneHeld = (nf != 0);
         }
+        if (id == paramIdBase + 3)
+        {
+            snap.active = (nf != 0);
+            // Force a rebuild against whatever the master has now
+            mtsTablesStale = true;
+        }
+        if (id == paramIdBase + 4)
+        {
+            snap.strength = std::clamp(nf, 0., 1.);
+        }
+        if (id == paramIdBase + 5)
+        {
+            snap.hysteresis = std::clamp(nf, 0., 50.) / 100.0;
+        }
+        if (id == paramIdBase + 6)
+        {
+            requestedNotePorts = std::clamp(static_cast<int>(std::round(nf)), 1, maxNotePorts);
+            _host.requestCallback();
+        }
+        if (id == paramIdBase + filterNotesParam)
+        {
+            filterNotes = nf > 0.5;
+            // Force a read against whatever the master has now
+            mtsTablesStale = true;
+        }
+        if (portChannelParam(id))
+        {
+            portTuningChannel[id - paramIdBase - portChannelParamBase] =
+                std::clamp(static_cast<int>(std::round(nf)), 0, 16);
+            // A channel no port read before may have stale tables
+            mtsTablesStale = true;
+        }
     }
     bool tuningActive() const { return mtsClient && MTS_HasMaster(mtsClient); }
+    void heldNoteOn(int key) {}
+    void heldNoteOff(int key) {}
+    void handleMidi(const clap_event_midi *mevt) {}
+    bool nextTuningChange(uint32_t upTo, uint32_t &at) { return false; }
+    int tuningChannel(int port, int channel) const
+    {
+        return portTuningChannel[port] ? portTuningChannel[port] - 1 : channel;
+    }
 
     float retuningFor(int key, int channel) const
     {
@@ -317,6 +637,7 @@ struct MTSNE : public clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::
 
     void paramsFlush(const clap_input_events *in, const clap_output_events *out) noexcept override
     {
+        TNC_REALTIME_SCOPE();
         paramsFlushTuningCore(this, in, out);
     }
 
@@ -0,0 +1,94 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_NOTE_PORTS_H
+#define TUNING_NOTE_CLAPS_NOTE_PORTS_H
+
+#include <clap/plugin.h>
+#include <clap/ext/note-ports.h>
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+ * Each instance can expose up to maxNotePorts input / output port pairs. Input port N is
+ * forwarded to output port N, and all the per note state is indexed [port][channel][key].
+ * That state holds only the ports in use, so an instance with one port pays for one.
+ */
+static constexpr int maxNotePorts = 8;
+
+template <typename V> using NoteArray = std::vector<std::array<std::array<V, 128>, 16>>;
+
+inline uint32_t voiceIndex(int port, int channel, int key)
+{
+    return ((uint32_t)port * 16 + channel) * 128 + key;
+}
+
+inline int notePortFor(int16_t portIndex, uint32_t notePorts)
+{
+    return (portIndex >= 0 && (uint32_t)portIndex < notePorts) ? portIndex : 0;
+}
+
+inline bool notePortsInfoCore(uint32_t index, bool isInput, const char *prefix,
+                              clap_note_port_info *info)
+{
+    info->id = 2 * index + 1 + (isInput ? 1 : 0);
+    info->supported_dialects = CLAP_NOTE_DIALECT_CLAP | CLAP_NOTE_DIALECT_MIDI |
+                               CLAP_NOTE_DIALECT_MIDI_MPE | CLAP_NOTE_DIALECT_MIDI2;
+    info->preferred_dialect = CLAP_NOTE_DIALECT_CLAP;
+
+    auto nm = std::string(prefix) + (isInput ? " Note Input" : " Note Output");
+    if (index > 0)
+        nm += " " + std::to_string(index + 1);
+    strncpy(info->name, nm.c_str(), CLAP_NAME_SIZE - 1);
+    info->name[CLAP_NAME_SIZE - 1] = 0;
+    return true;
+}
+
+// Sizes and clears the per note state for the ports in use. Never called while processing.
+template <typename T> void sizeNoteStateCore(T *that)
+{
+    auto n = that->notePorts;
+    that->noteState.assign(n, {});
+    that->sclTuning.assign(n, {});
+    that->expressionTuning.assign(n, {});
+    that->releases.resize(n * 16 * 128);
+    that->snap.resize(n);
+}
+
+/*
+ * The host may only rescan the port list while we are deactivated, so a change to the port
+ * count parameter asks for a restart and is applied on the main thread once we are stopped.
+ */
+template <typename T, typename H> void updateNotePortsCore(T *that, H &host, bool isActive)
+{
+    auto req = that->requestedNotePorts.load();
+    if (req == that->notePorts)
+        return;
+
+    if (isActive)
+    {
+        host.requestRestart();
+        return;
+    }
+
+    that->notePorts = req;
+    sizeNoteStateCore(that);
+    if (host.canUseNotePorts())
+        host.notePortsRescan(CLAP_NOTE_PORTS_RESCAN_ALL);
+}
+
+#endif // TUNING_NOTE_CLAPS_NOTE_PORTS_H
@@ -0,0 +1,174 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_PARAM_SNAPSHOT_H
+#define TUNING_NOTE_CLAPS_PARAM_SNAPSHOT_H
+
+#include <clap/events.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+
+#include "triple_buffer.h"
+
+/*
+ * ParamSnapshot moves a plugin's N parameter values, by parameter index, between the thread
+ * which owns them and the main thread without either waiting on the other.
+ *
+ * The owner is whoever runs process() or paramsFlush(). It notes values as the host sends
+ * them, and publish() copies the live values into a triple buffer once at the end of the
+ * block, pushing an output event for each value the host doesn't already know, such as one
+ * we clamped. The main thread reads values() for paramsValue and stateSave.
+ *
+ * State goes the other way: stateLoad posts the loaded values and the owner applies them at
+ * the start of its next block. Until a published snapshot includes them, values() shows the
+ * posted ones, so a save straight after a load gives back what was loaded.
+ */
+template <size_t N> struct ParamSnapshot
+{
+    using Values = std::array<double, N>;
+
+    // Owner side
+
+    void hostSent(clap_id index, double value)
+    {
+        if (index >= N)
+            return;
+        sent[index] = true;
+        sentValues[index] = value;
+        changed = true;
+    }
+
+    void markChanged() { changed = true; }
+
+    // True if there was a load to apply
+    template <typename F> bool applyLoaded(F &&apply)
+    {
+        if (!loads.consume())
+            return false;
+        const auto &l = loads.read();
+        for (size_t i = 0; i < N; ++i)
+            if (l.present[i])
+                apply((clap_id)i, l.values[i]);
+        appliedSerial = l.serial;
+        changed = true;
+        return true;
+    }
+
+    // valueAt(i) gives the live value at index i
+    template <typename F>
+    void publish(F &&valueAt, const clap_output_events *out, clap_id idBase, uint32_t time)
+    {
+        if (!changed)
+            return;
+        changed = false;
+
+        auto &p = published.writeBuffer();
+        for (size_t i = 0; i < N; ++i)
+        {
+            auto v = valueAt((clap_id)i);
+            p.values[i] = v;
+
+            auto tell = sent[i] ? v != sentValues[i] : v != lastValues[i];
+            sent[i] = false;
+            lastValues[i] = v;
+            if (!tell || !out)
+                continue;
+
+            auto e = clap_event_param_value();
+            e.header.size = sizeof(clap_event_param_value);
+            e.header.type = (uint16_t)CLAP_EVENT_PARAM_VALUE;
+            e.header.time = time;
+            e.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+            e.header.flags = 0;
+            e.param_id = idBase + (clap_id)i;
+            e.cookie = nullptr;
+            e.note_id = -1;
+            e.port_index = -1;
+            e.channel = -1;
+            e.key = -1;
+            e.value = v;
+            out->try_push(out, &e.header);
+        }
+        p.loadSerial = appliedSerial;
+        published.publish();
+    }
+
+    // Main thread side
+
+    const Values &values()
+    {
+        published.consume();
+        const auto &p = published.read();
+        if (p.loadSerial == postedSerial)
+            return p.values;
+
+        merged = p.values;
+        for (size_t i = 0; i < N; ++i)
+            if (posted.present[i])
+                merged[i] = posted.values[i];
+        return merged;
+    }
+
+    // Values posted earlier but not yet applied are kept unless these replace them
+    void post(const std::map<clap_id, double> &vals, clap_id idBase)
+    {
+        published.consume();
+        auto pending = published.read().loadSerial != postedSerial;
+
+        auto &l = loads.writeBuffer();
+        if (pending)
+            l = posted;
+        else
+            l.present.fill(false);
+        for (const auto &[id, v] : vals)
+        {
+            if (id < idBase || id - idBase >= N)
+                continue;
+            l.values[id - idBase] = v;
+            l.present[id - idBase] = true;
+        }
+        l.serial = ++postedSerial;
+        posted = l;
+        loads.publish();
+    }
+
+  private:
+    struct Published
+    {
+        Values values{};
+        uint64_t loadSerial{0};
+    };
+    struct Loaded
+    {
+        Values values{};
+        std::array<bool, N> present{};
+        uint64_t serial{0};
+    };
+    TripleBuffer<Published> published;
+    TripleBuffer<Loaded> loads;
+
+    // Owned by the owner
+    Values lastValues{}, sentValues{};
+    std::array<bool, N> sent{};
+    bool changed{true};
+    uint64_t appliedSerial{0};
+
+    // Owned by the main thread
+    uint64_t postedSerial{0};
+    Loaded posted;
+    Values merged{};
+};
+
+#endif // TUNING_NOTE_CLAPS_PARAM_SNAPSHOT_H
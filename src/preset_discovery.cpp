@@ -0,0 +1,209 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#include "clap_creators.h"
+
+#include <clap/clap.h>
+
+#if __has_include(<clap/factory/preset-discovery.h>)
+#include <clap/factory/preset-discovery.h>
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "preset_index.h"
+
+extern clap_plugin_descriptor EDNM_desc;
+
+/*
+ * The Scala library provider offers every .scl file in our scale directories as an
+ * EDNMToNoteExpression preset. The host walks the directories and asks for each file's
+ * metadata in turn; PresetIndex answers for files which haven't changed since the last scan
+ * without opening them, so rescanning a large library at startup costs a stat per file.
+ *
+ * The scale directories are ~/Documents/tuning-note-claps/scales and any listed, one per
+ * line, in ~/Documents/tuning-note-claps/scale-libraries.txt.
+ */
+namespace
+{
+bool isDirectory(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+std::vector<std::string> scaleLibraries()
+{
+    std::vector<std::string> res;
+    auto base = userDataDirectory();
+    if (base.empty())
+        return res;
+
+    if (isDirectory(base + "/scales"))
+        res.push_back(base + "/scales");
+
+    std::ifstream ifs(base + "/scale-libraries.txt");
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (isDirectory(line))
+            res.push_back(line);
+    }
+    return res;
+}
+
+std::string stem(const std::string &path)
+{
+    auto slash = path.find_last_of("/\\");
+    auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+    auto dot = name.find_last_of('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+const clap_preset_discovery_provider_descriptor scalaLibraryDesc = {
+    CLAP_VERSION, "org.surge-synth-team.ScalaLibrary", "Scala Tuning Library",
+    "Surge Synth Team"};
+
+struct ScalaLibraryProvider
+{
+    clap_preset_discovery_provider provider;
+    const clap_preset_discovery_indexer *indexer;
+    PresetIndex index;
+    bool indexLoaded{false};
+
+    // Save as we go, so a scan the host abandons still spares the next one most of the work
+    static constexpr uint32_t saveEvery = 256;
+
+    ScalaLibraryProvider(const clap_preset_discovery_indexer *indexer) : indexer(indexer)
+    {
+        provider.desc = &scalaLibraryDesc;
+        provider.provider_data = this;
+        provider.init = [](const clap_preset_discovery_provider *p) {
+            return self(p)->init();
+        };
+        provider.destroy = [](const clap_preset_discovery_provider *p) {
+            auto s = self(p);
+            if (s->index.changes)
+                s->index.save(PresetIndex::defaultPath());
+            delete s;
+        };
+        provider.get_metadata = [](const clap_preset_discovery_provider *p, uint32_t kind,
+                                   const char *location,
+                                   const clap_preset_discovery_metadata_receiver *r) {
+            return self(p)->metadata(kind, location, r);
+        };
+        provider.get_extension = [](const clap_preset_discovery_provider *,
+                                    const char *) -> const void * { return nullptr; };
+    }
+
+    static ScalaLibraryProvider *self(const clap_preset_discovery_provider *p)
+    {
+        return static_cast<ScalaLibraryProvider *>(p->provider_data);
+    }
+
+    bool init()
+    {
+        clap_preset_discovery_filetype ft = {"Scala Scale", "A scale in the Scala .scl format",
+                                             "scl"};
+        indexer->declare_filetype(indexer, &ft);
+
+        // Keep this cheap; the files are only looked at when the host asks for them
+        for (const auto &dir : scaleLibraries())
+        {
+            auto nm = stem(dir);
+            clap_preset_discovery_location loc = {CLAP_PRESET_DISCOVERY_IS_USER_CONTENT,
+                                                  nm.c_str(), CLAP_PRESET_DISCOVERY_LOCATION_FILE,
+                                                  dir.c_str()};
+            indexer->declare_location(indexer, &loc);
+        }
+        return true;
+    }
+
+    bool metadata(uint32_t kind, const char *location,
+                  const clap_preset_discovery_metadata_receiver *r)
+    {
+        if (kind != CLAP_PRESET_DISCOVERY_LOCATION_FILE || !location)
+            return false;
+
+        if (!indexLoaded)
+        {
+            index.load(PresetIndex::defaultPath());
+            indexLoaded = true;
+        }
+
+        auto e = index.scan(location);
+        if (index.changes >= saveEvery)
+            index.save(PresetIndex::defaultPath());
+        if (!e || e->notes == 0)
+        {
+            r->on_error(r, 0, "Not a readable Scala scale");
+            return false;
+        }
+
+        auto path = std::string(location);
+        auto desc = std::to_string(e->notes) + " note scale";
+        if (e->mapping)
+            desc += " with keyboard mapping";
+        if (!e->description.empty())
+            desc += ". " + e->description;
+
+        if (!r->begin_preset(r, stem(path).c_str(), nullptr))
+            return true;
+        clap_universal_plugin_id pid = {"clap", EDNM_desc.id};
+        r->add_plugin_id(r, &pid);
+        r->set_description(r, desc.c_str());
+        r->set_timestamps(r, CLAP_TIMESTAMP_UNKNOWN, (clap_timestamp)e->modified());
+        r->add_feature(r, "microtonal");
+        return true;
+    }
+};
+
+uint32_t scala_library_count(const clap_preset_discovery_factory *) { return 1; }
+const clap_preset_discovery_provider_descriptor *
+scala_library_get_descriptor(const clap_preset_discovery_factory *, uint32_t index)
+{
+    return index == 0 ? &scalaLibraryDesc : nullptr;
+}
+const clap_preset_discovery_provider *
+scala_library_create(const clap_preset_discovery_factory *,
+                     const clap_preset_discovery_indexer *indexer, const char *provider_id)
+{
+    if (strcmp(provider_id, scalaLibraryDesc.id) != 0)
+        return nullptr;
+    return &(new ScalaLibraryProvider(indexer))->provider;
+}
+
+const clap_preset_discovery_factory scalaLibraryFactory = {
+    scala_library_count, scala_library_get_descriptor, scala_library_create};
+} // namespace
+
+const void *get_preset_discovery_factory(const char *factory_id)
+{
+    if (strcmp(factory_id, CLAP_PRESET_DISCOVERY_FACTORY_ID) == 0 ||
+        strcmp(factory_id, CLAP_PRESET_DISCOVERY_FACTORY_ID_COMPAT) == 0)
+        return &scalaLibraryFactory;
+    return nullptr;
+}
+
+#else
+
+// Built against a CLAP without preset discovery
+const void *get_preset_discovery_factory(const char *) { return nullptr; }
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_PRESET_INDEX_H
+#define TUNING_NOTE_CLAPS_PRESET_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(_WIN32)
+#include <direct.h>
+#endif
+
+#include "Tunings.h"
+
+#include "key_layout.h"
+
+// A .kbm next to a .scl with the same name is used as its keyboard mapping
+inline std::string mappingPathFor(const std::string &sclPath)
+{
+    auto dot = sclPath.find_last_of('.');
+    return sclPath.substr(0, dot) + ".kbm";
+}
+
+inline std::string mappingFor(const std::string &sclPath)
+{
+    auto kbm = mappingPathFor(sclPath);
+    return std::ifstream(kbm).good() ? kbm : std::string();
+}
+
+/*
+ * PresetIndex remembers what we learnt about each .scl file so a host's preset scan only
+ * reads the files which changed since the last one. Entries are keyed by path and carry the
+ * file's mtime and size. When those move we hash the contents, and only parse the file when
+ * the hash moved too. Files which fail to parse keep an entry with no notes, so they aren't
+ * parsed again either, while files which are gone drop out. The entry also notes whether a
+ * .kbm sits next to the scale and its mtime, which a stat keeps current without opening
+ * anything.
+ *
+ * The index is a tab separated text file in our user data directory, rewritten through a
+ * temporary file so a scan which dies part way leaves the previous one intact.
+ */
+struct PresetIndex
+{
+    struct Entry
+    {
+        int64_t mtime{0};
+        uint64_t size{0};
+        uint64_t hash{0};
+        int notes{0}; // 0 if the file is not a readable scale
+        bool mapping{false};
+        int64_t mappingMtime{0};
+        std::string description;
+
+        // The later of the scale's and its mapping's modification times
+        int64_t modified() const { return mapping ? std::max(mtime, mappingMtime) : mtime; }
+    };
+
+    std::map<std::string, Entry> entries;
+    uint32_t changes{0}; // since the last save
+
+    static std::string defaultPath() { return userDataDirectory() + "/preset-index.tsv"; }
+
+    bool load(const std::string &path)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs)
+            return false;
+
+        std::string line;
+        if (!std::getline(ifs, line) || line != header)
+            return false;
+
+        while (std::getline(ifs, line))
+        {
+            auto f = split(line);
+            if (f.size() != 8)
+                continue;
+            Entry e;
+            e.mtime = std::strtoll(f[1].c_str(), nullptr, 10);
+            e.size = std::strtoull(f[2].c_str(), nullptr, 10);
+            e.hash = std::strtoull(f[3].c_str(), nullptr, 16);
+            e.notes = std::atoi(f[4].c_str());
+            e.mapping = f[5] == "1";
+            e.mappingMtime = std::strtoll(f[6].c_str(), nullptr, 10);
+            e.description = f[7];
+            entries[f[0]] = e;
+        }
+        changes = 0;
+        return true;
+    }
+
+    bool save(const std::string &path)
+    {
+        makeParents(path);
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+            if (!ofs)
+                return false;
+            ofs << header << "\n";
+            for (const auto &[p, e] : entries)
+            {
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)e.hash);
+                ofs << escape(p) << "\t" << e.mtime << "\t" << e.size << "\t" << hash << "\t"
+                    << e.notes << "\t" << (e.mapping ? 1 : 0) << "\t" << e.mappingMtime << "\t"
+                    << escape(e.description) << "\n";
+            }
+            if (!ofs)
+                return false;
+        }
+        std::remove(path.c_str()); // Windows won't rename over an existing file
+        if (std::rename(tmp.c_str(), path.c_str()) != 0)
+            return false;
+        changes = 0;
+        return true;
+    }
+
+    // The entry for a .scl file, read from disk only if it changed. nullptr if it is gone.
+    const Entry *scan(const std::string &file)
+    {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0)
+        {
+            forget(file);
+            return nullptr;
+        }
+
+        struct stat kst;
+        auto mapped = stat(mappingPathFor(file).c_str(), &kst) == 0;
+        auto mappingMtime = mapped ? (int64_t)kst.st_mtime : 0;
+
+        auto it = entries.find(file);
+        if (it != entries.end() && it->second.mtime == (int64_t)st.st_mtime &&
+            it->second.size == (uint64_t)st.st_size)
+        {
+            auto &e = it->second;
+            if (e.mapping != mapped || e.mappingMtime != mappingMtime)
+            {
+                e.mapping = mapped;
+                e.mappingMtime = mappingMtime;
+                changes++;
+            }
+            return &e;
+        }
+
+        std::ifstream ifs(file, std::ios::binary);
+        if (!ifs)
+        {
+            forget(file);
+            return nullptr;
+        }
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        auto data = oss.str();
+
+        auto &e = entries[file];
+        e.mtime = (int64_t)st.st_mtime;
+        e.size = (uint64_t)st.st_size;
+        e.mapping = mapped;
+        e.mappingMtime = mappingMtime;
+        changes++;
+
+        auto h = hash(data);
+        if (it != entries.end() && e.hash == h)
+            return &e;
+        e.hash = h;
+
+        try
+        {
+            auto s = Tunings::parseSCLData(data);
+            e.notes = s.count;
+            e.description = s.description;
+        }
+        catch (const Tunings::TuningError &)
+        {
+            e.notes = 0;
+            e.description.clear();
+        }
+        return &e;
+    }
+
+  private:
+    static constexpr const char *header = "tuning-note-claps preset index 2";
+
+    // A file we can no longer read drops out of the index at the next save
+    void forget(const std::string &file)
+    {
+        if (entries.erase(file))
+            changes++;
+    }
+
+    // Our user data directory may not exist before the first save, nor its parents
+    static void makeParents(const std::string &path)
+    {
+        for (auto i = path.find_first_of("/\\", 1); i != std::string::npos;
+             i = path.find_first_of("/\\", i + 1))
+        {
+            auto dir = path.substr(0, i);
+#if defined(_WIN32)
+            _mkdir(dir.c_str());
+#else
+            mkdir(dir.c_str(), 0755);
+#endif
+        }
+    }
+
+    // FNV-1a, which is plenty to tell one revision of a small text file from another
+    static uint64_t hash(const std::string &data)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (auto c : data)
+        {
+            h ^= (uint8_t)c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static std::string escape(const std::string &s)
+    {
+        std::string res;
+        for (auto c : s)
+        {
+            switch (c)
+            {
+            case '\\':
+                res += "\\\\";
+                break;
+            case '\t':
+                res += "\\t";
+                break;
+            case '\n':
+                res += "\\n";
+                break;
+            case '\r':
+                res += "\\r";
+                break;
+            default:
+                res += c;
+                break;
+            }
+        }
+        return res;
+    }
+
+    static std::vector<std::string> split(const std::string &line)
+    {
+        std::vector<std::string> res(1);
+        for (size_t i = 0; i < line.size(); ++i)
+        {
+            auto c = line[i];
+            if (c == '\t')
+            {
+                res.emplace_back();
+            }
+            else if (c == '\\' && i + 1 < line.size())
+            {
+                auto n = line[++i];
+                res.back() += n == 't' ? '\t' : n == 'n' ? '\n' : n == 'r' ? '\r' : n;
+            }
+            else
+            {
+                res.back() += c;
+            }
+        }
+        return res;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_PRESET_INDEX_H
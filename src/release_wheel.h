@@ -0,0 +1,237 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_RELEASE_WHEEL_H
+#define TUNING_NOTE_CLAPS_RELEASE_WHEEL_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+enum NoteState : uint8_t
+{
+    NOTE_OFF = 0,
+    NOTE_HELD,
+    NOTE_RELEASING,
+    NOTE_DROPPED // held by the host but filtered, so nothing about it is sent on
+};
+
+/*
+ * ReleaseWheel is a hierarchical timer wheel keyed by absolute sample time. Each of the N
+ * ids given to resize() (one per port / channel / key) can have one pending deadline. Six
+ * levels of 64 slots cover 2^36 samples ahead, and an occupancy bitmask per level lets
+ * advance() jump straight to the next full slot, so a block costs O(expired) rather than
+ * O(N).
+ *
+ * Entries live in the wheel according to the highest bit where their deadline differs
+ * from now, which keeps every entry in a slot strictly ahead of now on its level. When
+ * now reaches a slot on a higher level its entries cascade down until they expire.
+ */
+struct ReleaseWheel
+{
+    static constexpr int levelBits = 6;
+    static constexpr int slotsPerLevel = 1 << levelBits;
+    static constexpr int levels = 6;
+    static constexpr uint64_t maxDelay = (1ULL << (levelBits * levels)) - 1;
+    static constexpr uint32_t none = 0xFFFFFFFF;
+
+    struct Entry
+    {
+        uint64_t deadline{0};
+        uint32_t next{none}, prev{none};
+        uint8_t level{0}, slot{0};
+        bool scheduled{false};
+    };
+
+    std::vector<Entry> entries;
+    std::array<std::array<uint32_t, slotsPerLevel>, levels> heads;
+    std::array<uint64_t, levels> occupied;
+    uint64_t now{0};
+
+    ReleaseWheel() { clear(0); }
+
+    // Allocates, so only outside process(); drops whatever was scheduled
+    void resize(uint32_t ids)
+    {
+        entries.assign(ids, Entry());
+        clear(now);
+    }
+
+    void clear(uint64_t at)
+    {
+        for (auto &e : entries)
+            e = Entry();
+        for (auto &l : heads)
+            l.fill(none);
+        occupied.fill(0);
+        now = at;
+    }
+
+    bool isScheduled(uint32_t id) const { return entries[id].scheduled; }
+
+    void schedule(uint32_t id, uint64_t deadline)
+    {
+        if (entries[id].scheduled)
+            cancel(id);
+
+        if (deadline < now)
+            deadline = now;
+        if (deadline - now > maxDelay)
+            deadline = now + maxDelay;
+
+        entries[id].deadline = deadline;
+        entries[id].scheduled = true;
+        insert(id);
+    }
+
+    void cancel(uint32_t id)
+    {
+        auto &e = entries[id];
+        if (!e.scheduled)
+            return;
+
+        if (e.prev != none)
+            entries[e.prev].next = e.next;
+        else
+            heads[e.level][e.slot] = e.next;
+        if (e.next != none)
+            entries[e.next].prev = e.prev;
+
+        if (heads[e.level][e.slot] == none)
+            occupied[e.level] &= ~(1ULL << e.slot);
+
+        e.next = none;
+        e.prev = none;
+        e.scheduled = false;
+    }
+
+    // Expire everything with a deadline at or before 'to', calling onExpire(id) for each
+    template <typename F> void advance(uint64_t to, F &&onExpire)
+    {
+        int level;
+        uint64_t slotStart;
+        while (nextOccupied(level, slotStart) && slotStart <= to)
+        {
+            if (slotStart > now)
+                now = slotStart;
+
+            auto slot = (int)((slotStart >> (level * levelBits)) & (slotsPerLevel - 1));
+            auto id = heads[level][slot];
+            heads[level][slot] = none;
+            occupied[level] &= ~(1ULL << slot);
+
+            while (id != none)
+            {
+                auto &e = entries[id];
+                auto next = e.next;
+                e.next = none;
+                e.prev = none;
+                if (e.deadline <= to)
+                {
+                    e.scheduled = false;
+                    onExpire(id);
+                }
+                else
+                {
+                    // Lands on a lower level since it is within this slot
+                    insert(id);
+                }
+                id = next;
+            }
+        }
+        if (to > now)
+            now = to;
+    }
+
+  private:
+    static int lowestBit(uint64_t v)
+    {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanForward64(&r, v);
+        return (int)r;
+#else
+        return __builtin_ctzll(v);
+#endif
+    }
+
+    static int highestBit(uint64_t v)
+    {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanReverse64(&r, v);
+        return (int)r;
+#else
+        return 63 - __builtin_clzll(v);
+#endif
+    }
+
+    void insert(uint32_t id)
+    {
+        auto &e = entries[id];
+        auto diff = e.deadline ^ now;
+        auto level = diff == 0 ? 0 : highestBit(diff) / levelBits;
+        if (level >= levels)
+            level = levels - 1; // wraps round the top level; see nextOccupied
+
+        auto slot = (int)((e.deadline >> (level * levelBits)) & (slotsPerLevel - 1));
+        e.level = (uint8_t)level;
+        e.slot = (uint8_t)slot;
+        e.prev = none;
+        e.next = heads[level][slot];
+        if (e.next != none)
+            entries[e.next].prev = id;
+        heads[level][slot] = id;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    bool nextOccupied(int &level, uint64_t &slotStart) const
+    {
+        bool found = false;
+        for (int l = 0; l < levels; ++l)
+        {
+            if (!occupied[l])
+                continue;
+
+            auto shift = l * levelBits;
+            auto nowSlot = (int)((now >> shift) & (slotsPerLevel - 1));
+
+            // The current top level slot can only hold entries a full rotation away, so
+            // search it last there
+            auto from = (l == levels - 1) ? (nowSlot + 1) & (slotsPerLevel - 1) : nowSlot;
+            auto rotated = from == 0 ? occupied[l]
+                                     : (occupied[l] >> from) |
+                                           (occupied[l] << (slotsPerLevel - from));
+            auto slot = (from + lowestBit(rotated)) & (slotsPerLevel - 1);
+
+            auto levelRange = 1ULL << (shift + levelBits);
+            auto start = (now & ~(levelRange - 1)) + ((uint64_t)slot << shift);
+            if (l == levels - 1 && slot <= nowSlot)
+                start += levelRange;
+
+            if (!found || start < slotStart)
+            {
+                found = true;
+                level = l;
+                slotStart = start;
+            }
+        }
+        return found;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_RELEASE_WHEEL_H
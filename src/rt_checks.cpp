@@ -0,0 +1,269 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#include "rt_checks.h"
+
+#if TUNING_NOTE_CLAPS_RT_CHECKS
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define TNC_RT_HAS_BACKTRACE 1
+#endif
+
+#if defined(__GLIBC__)
+#include <dlfcn.h>
+#include <pthread.h>
+
+extern "C"
+{
+    void *__libc_malloc(size_t);
+    void *__libc_calloc(size_t, size_t);
+    void *__libc_realloc(void *, size_t);
+    void *__libc_memalign(size_t, size_t);
+    void __libc_free(void *);
+}
+#define TNC_RT_RAW_MALLOC __libc_malloc
+#define TNC_RT_RAW_FREE __libc_free
+#define TNC_RT_RAW_ALIGNED_ALLOC(align, sz) __libc_memalign(align, sz)
+#define TNC_RT_RAW_ALIGNED_FREE __libc_free
+#elif defined(_WIN32)
+#include <malloc.h>
+#define TNC_RT_RAW_MALLOC std::malloc
+#define TNC_RT_RAW_FREE std::free
+#define TNC_RT_RAW_ALIGNED_ALLOC(align, sz) _aligned_malloc(sz, align)
+#define TNC_RT_RAW_ALIGNED_FREE _aligned_free
+#else
+#define TNC_RT_RAW_MALLOC std::malloc
+#define TNC_RT_RAW_FREE std::free
+#define TNC_RT_RAW_ALIGNED_ALLOC(align, sz) rtchecks::posixAlignedAlloc(align, sz)
+#define TNC_RT_RAW_ALIGNED_FREE std::free
+#endif
+
+// The tools build with hidden visibility, but the hooks have to be seen by the shared
+// libraries they run, such as libstdc++ and MTS-ESP, to catch their allocations and locks
+#if defined(__GNUC__)
+#define TNC_RT_HOOK __attribute__((visibility("default")))
+#else
+#define TNC_RT_HOOK
+#endif
+
+namespace rtchecks
+{
+namespace
+{
+thread_local bool reporting{false};
+std::atomic<uint64_t> violationCount{0};
+
+void report(const char *what)
+{
+    if (realtimeDepth == 0 || reporting)
+        return;
+
+    // Anything the report itself does is not the plugin's fault
+    reporting = true;
+    violationCount++;
+    fprintf(stderr, "rt-checks: %s on a realtime thread\n", what);
+#if TNC_RT_HAS_BACKTRACE
+    void *frames[48];
+    auto n = backtrace(frames, 48);
+    backtrace_symbols_fd(frames, n, 2);
+#endif
+    reporting = false;
+}
+
+#if TNC_RT_HAS_BACKTRACE
+// The first backtrace() loads the unwinder, which allocates, so do that up front
+struct PrimeBacktrace
+{
+    PrimeBacktrace()
+    {
+        void *frames[2];
+        backtrace(frames, 2);
+    }
+} primeBacktrace;
+#endif
+} // namespace
+
+#if !defined(__GLIBC__) && !defined(_WIN32)
+void *posixAlignedAlloc(size_t align, size_t sz)
+{
+    void *p = nullptr;
+    return posix_memalign(&p, align, sz) == 0 ? p : nullptr;
+}
+#endif
+
+uint64_t violations() { return violationCount; }
+} // namespace rtchecks
+
+TNC_RT_HOOK void *operator new(size_t sz)
+{
+    rtchecks::report("operator new");
+    if (auto p = TNC_RT_RAW_MALLOC(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+TNC_RT_HOOK void *operator new[](size_t sz)
+{
+    rtchecks::report("operator new[]");
+    if (auto p = TNC_RT_RAW_MALLOC(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+TNC_RT_HOOK void *operator new(size_t sz, const std::nothrow_t &) noexcept
+{
+    rtchecks::report("operator new");
+    return TNC_RT_RAW_MALLOC(sz ? sz : 1);
+}
+TNC_RT_HOOK void *operator new[](size_t sz, const std::nothrow_t &) noexcept
+{
+    rtchecks::report("operator new[]");
+    return TNC_RT_RAW_MALLOC(sz ? sz : 1);
+}
+
+TNC_RT_HOOK void operator delete(void *p) noexcept
+{
+    if (p)
+        rtchecks::report("operator delete");
+    TNC_RT_RAW_FREE(p);
+}
+TNC_RT_HOOK void operator delete[](void *p) noexcept
+{
+    if (p)
+        rtchecks::report("operator delete[]");
+    TNC_RT_RAW_FREE(p);
+}
+TNC_RT_HOOK void operator delete(void *p, size_t) noexcept { operator delete(p); }
+TNC_RT_HOOK void operator delete[](void *p, size_t) noexcept { operator delete[](p); }
+TNC_RT_HOOK void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    operator delete(p);
+}
+TNC_RT_HOOK void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    operator delete[](p);
+}
+
+// Types aligned past the default, such as a cache line, come through these
+TNC_RT_HOOK void *operator new(size_t sz, std::align_val_t al)
+{
+    rtchecks::report("operator new");
+    if (auto p = TNC_RT_RAW_ALIGNED_ALLOC((size_t)al, sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+TNC_RT_HOOK void *operator new[](size_t sz, std::align_val_t al)
+{
+    rtchecks::report("operator new[]");
+    if (auto p = TNC_RT_RAW_ALIGNED_ALLOC((size_t)al, sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+TNC_RT_HOOK void *operator new(size_t sz, std::align_val_t al,
+                               const std::nothrow_t &) noexcept
+{
+    rtchecks::report("operator new");
+    return TNC_RT_RAW_ALIGNED_ALLOC((size_t)al, sz ? sz : 1);
+}
+TNC_RT_HOOK void *operator new[](size_t sz, std::align_val_t al,
+                                 const std::nothrow_t &) noexcept
+{
+    rtchecks::report("operator new[]");
+    return TNC_RT_RAW_ALIGNED_ALLOC((size_t)al, sz ? sz : 1);
+}
+
+TNC_RT_HOOK void operator delete(void *p, std::align_val_t) noexcept
+{
+    if (p)
+        rtchecks::report("operator delete");
+    TNC_RT_RAW_ALIGNED_FREE(p);
+}
+TNC_RT_HOOK void operator delete[](void *p, std::align_val_t) noexcept
+{
+    if (p)
+        rtchecks::report("operator delete[]");
+    TNC_RT_RAW_ALIGNED_FREE(p);
+}
+TNC_RT_HOOK void operator delete(void *p, size_t, std::align_val_t al) noexcept
+{
+    operator delete(p, al);
+}
+TNC_RT_HOOK void operator delete[](void *p, size_t, std::align_val_t al) noexcept
+{
+    operator delete[](p, al);
+}
+TNC_RT_HOOK void operator delete(void *p, std::align_val_t al,
+                                 const std::nothrow_t &) noexcept
+{
+    operator delete(p, al);
+}
+TNC_RT_HOOK void operator delete[](void *p, std::align_val_t al,
+                                   const std::nothrow_t &) noexcept
+{
+    operator delete[](p, al);
+}
+
+#if defined(__GLIBC__)
+namespace
+{
+using MutexLock = int (*)(pthread_mutex_t *);
+MutexLock realMutexLock{nullptr};
+
+// dlsym can itself allocate and lock, so the real lock is found as the library loads, ahead
+// of ordinary static initializers, and never from a realtime thread
+__attribute__((constructor(101))) void resolveRealMutexLock()
+{
+    realMutexLock = (MutexLock)dlsym(RTLD_NEXT, "pthread_mutex_lock");
+}
+} // namespace
+
+extern "C"
+{
+    TNC_RT_HOOK void *malloc(size_t sz)
+    {
+        rtchecks::report("malloc");
+        return __libc_malloc(sz);
+    }
+    TNC_RT_HOOK void *calloc(size_t n, size_t sz)
+    {
+        rtchecks::report("calloc");
+        return __libc_calloc(n, sz);
+    }
+    TNC_RT_HOOK void *realloc(void *p, size_t sz)
+    {
+        rtchecks::report("realloc");
+        return __libc_realloc(p, sz);
+    }
+    TNC_RT_HOOK void free(void *p)
+    {
+        if (p)
+            rtchecks::report("free");
+        __libc_free(p);
+    }
+    TNC_RT_HOOK int pthread_mutex_lock(pthread_mutex_t *m)
+    {
+        // Only a library initialized before us can get here with nothing resolved yet
+        if (!realMutexLock)
+            resolveRealMutexLock();
+
+        rtchecks::report("pthread_mutex_lock");
+        return realMutexLock(m);
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_RT_CHECKS_H
+#define TUNING_NOTE_CLAPS_RT_CHECKS_H
+
+/*
+ * A test build mode which catches the audio thread allocating or locking. Configure with
+ * -DTUNING_NOTE_CLAPS_RT_CHECKS=ON, which links rt-checks into the executables driving the
+ * plugins (the benchmark, replay and round trip tools) but not into the .clap. Each process()
+ * and paramsFlush() runs inside a RealtimeScope; while one is open on a thread, operator new
+ * (aligned or not), malloc and friends and pthread mutex locks on that thread print the call
+ * stack to stderr and count a violation, which the tool turns into a failing exit code.
+ *
+ * malloc and mutex interception rely on symbol interposition, so they are only compiled on
+ * glibc; elsewhere operator new is still checked.
+ */
+
+#if TUNING_NOTE_CLAPS_RT_CHECKS
+
+#include <cstdint>
+
+namespace rtchecks
+{
+// Kept here so the plugins need nothing from rt-checks; the tools' interposer reads it
+inline thread_local int realtimeDepth{0};
+
+uint64_t violations(); // in rt-checks, so only the tools call it
+
+struct RealtimeScope
+{
+    RealtimeScope() { realtimeDepth++; }
+    ~RealtimeScope() { realtimeDepth--; }
+};
+} // namespace rtchecks
+
+#define TNC_REALTIME_SCOPE() rtchecks::RealtimeScope tncRealtimeScope
+
+#else
+
+#define TNC_REALTIME_SCOPE()
+
+#endif
+
+#endif // TUNING_NOTE_CLAPS_RT_CHECKS_H
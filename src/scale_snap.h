@@ -0,0 +1,108 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_SCALE_SNAP_H
+#define TUNING_NOTE_CLAPS_SCALE_SNAP_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#include "note_ports.h"
+
+/*
+ * ScaleSnap quantizes an upstream tuning expression to the nearest pitch of the tuning its
+ * note plays. The pitches of all 128 keys are kept as a sorted table per tuning channel,
+ * rebuilt only when the tuning changes, so each snap is a binary search over at most 128
+ * doubles with no allocation. Channels which play the same row share one table.
+ */
+struct ScaleSnap
+{
+    bool active{false};
+    double strength{1.0};   // 0 leaves the pitch alone, 1 lands exactly on the degree
+    double hysteresis{0.0}; // in semitones; how much closer a new degree must be to win
+
+    using Rows = std::array<const double *, 16>;
+
+    ScaleSnap()
+    {
+        static const std::array<double, 128> flat{};
+        Rows rows;
+        rows.fill(flat.data());
+        rebuild(rows);
+    }
+
+    // rows[c] is the retuning of each key on tuning channel c, in semitones from 12-TET
+    void rebuild(const Rows &rows)
+    {
+        for (int c = 0; c < 16; ++c)
+        {
+            int shared = 0;
+            while (shared < c && rows[shared] != rows[c])
+                shared++;
+            if (shared < c)
+            {
+                tableFor[c] = tableFor[shared];
+                continue;
+            }
+
+            tableFor[c] = (uint8_t)c;
+            auto &p = pitches[c];
+            for (int k = 0; k < 128; ++k)
+                p[k] = k + rows[c][k];
+            std::sort(p.begin(), p.end());
+        }
+
+        // Degree indices from the prior tables mean nothing now
+        for (auto &p : lastDegree)
+            for (auto &c : p)
+                c.fill(-1);
+    }
+
+    // One set of degrees per port in use; allocates, so only outside process()
+    void resize(uint32_t ports)
+    {
+        lastDegree.assign(ports, {});
+        for (auto &p : lastDegree)
+            for (auto &c : p)
+                c.fill(-1);
+    }
+
+    void resetNote(int port, int channel, int key) { lastDegree[port][channel][key] = -1; }
+
+    // Takes and returns a tuning offset in semitones relative to key, which plays on the
+    // given tuning channel
+    double apply(int port, int channel, int key, int tuningChannel, double offset)
+    {
+        const auto &table = pitches[tableFor[tuningChannel]];
+        auto pitch = key + offset;
+        auto n = (int)(std::lower_bound(table.begin(), table.end(), pitch) - table.begin());
+        if (n == 128 || (n > 0 && pitch - table[n - 1] < table[n] - pitch))
+            n--;
+
+        auto &last = lastDegree[port][channel][key];
+        if (last >= 0 && last != n &&
+            std::fabs(pitch - table[last]) < std::fabs(pitch - table[n]) + hysteresis)
+            n = last;
+        last = (int16_t)n;
+
+        return offset + strength * (table[n] - pitch);
+    }
+
+    std::array<std::array<double, 128>, 16> pitches;
+    std::array<uint8_t, 16> tableFor{};
+    NoteArray<int16_t> lastDegree;
+};
+
+#endif // TUNING_NOTE_CLAPS_SCALE_SNAP_H
@@ -0,0 +1,334 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_TRACE_H
+#define TUNING_NOTE_CLAPS_TRACE_H
+
+/*
+ * Timeline tracing for glitch hunting. Configure with -DTUNING_NOTE_CLAPS_TRACING=ON and run
+ * the host with TUNING_NOTE_CLAPS_TRACE_FILE set to a path; every instance then writes its
+ * events to that file in the Chrome trace event format, which chrome://tracing and
+ * ui.perfetto.dev both open.
+ *
+ * Each instance owns two single producer rings of fixed size records: one for whichever
+ * thread currently runs the processing state (the audio thread, or the main thread while
+ * deactivated) and one for main thread only work such as state load. A producer never
+ * blocks or allocates; if the ring is full the record is dropped and counted. A background
+ * thread drains all rings to the file.
+ *
+ * Without the build option the macros are empty. With it, but without the environment
+ * variable, no rings exist and each macro is a null pointer test.
+ */
+
+#if TUNING_NOTE_CLAPS_TRACING
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <process.h>
+#define TNC_TRACE_GETPID _getpid
+#else
+#include <unistd.h>
+#define TNC_TRACE_GETPID getpid
+#endif
+
+struct TraceRecord
+{
+    enum Kind : uint8_t
+    {
+        complete,
+        instant,
+        counter
+    };
+
+    const char *name; // must be a string literal; only the pointer is stored
+    uint64_t start, duration; // ns since the session started
+    int64_t value;
+    Kind kind;
+};
+
+struct TraceRing
+{
+    static constexpr uint32_t capacity = 4096; // a power of two
+    static constexpr uint32_t mask = capacity - 1;
+
+    std::string label;
+    uint32_t track{0};
+    bool named{false}; // the drain thread has written the track name
+
+    std::array<TraceRecord, capacity> records;
+    alignas(64) std::atomic<uint32_t> head{0}; // written by the producer
+    alignas(64) std::atomic<uint32_t> tail{0}; // written by the drain thread
+    std::atomic<uint32_t> dropped{0};
+
+    void push(const TraceRecord &r)
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= capacity)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        records[h & mask] = r;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    template <typename F> void drain(F &&f)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        auto h = head.load(std::memory_order_acquire);
+        for (; t != h; ++t)
+            f(records[t & mask]);
+        tail.store(t, std::memory_order_release);
+    }
+};
+
+struct TraceSession
+{
+    static TraceSession &get()
+    {
+        static TraceSession s;
+        return s;
+    }
+
+    std::chrono::steady_clock::time_point epoch{std::chrono::steady_clock::now()};
+
+    uint64_t now() const
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - epoch)
+            .count();
+    }
+
+    bool enabled() const { return file != nullptr; }
+
+    // Rings are added and removed from the main thread, as instances are created and destroyed
+    void add(TraceRing *r)
+    {
+        std::unique_lock<std::mutex> g(lock);
+        r->track = ++nextTrack;
+        rings.push_back(r);
+        if (!drainer.joinable())
+        {
+            stopping = false;
+            drainer = std::thread([this]() { run(); });
+        }
+    }
+
+    void remove(TraceRing *r)
+    {
+        std::unique_lock<std::mutex> g(lock);
+        write(r);
+        for (auto it = rings.begin(); it != rings.end(); ++it)
+        {
+            if (*it == r)
+            {
+                rings.erase(it);
+                break;
+            }
+        }
+        if (!rings.empty() || !drainer.joinable())
+            return;
+
+        stopping = true;
+        g.unlock();
+        wake.notify_all();
+        drainer.join();
+        fflush(file);
+    }
+
+  private:
+    TraceSession()
+    {
+        auto path = std::getenv("TUNING_NOTE_CLAPS_TRACE_FILE");
+        if (path && *path)
+            file = fopen(path, "w");
+        if (file)
+            fputs("[\n", file);
+    }
+
+    ~TraceSession()
+    {
+        // Instances still alive at exit never removed their rings, so the drainer may be
+        // running; it has to be done with the file before we close it
+        {
+            std::unique_lock<std::mutex> g(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (drainer.joinable())
+            drainer.join();
+
+        if (!file)
+            return;
+        for (auto *r : rings)
+            write(r);
+        // Chrome reads the array without a closing bracket, but be tidy when we can
+        if (ftell(file) > 2)
+            fseek(file, -2, SEEK_CUR);
+        fputs("\n]\n", file);
+        fclose(file);
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> g(lock);
+        while (!stopping)
+        {
+            wake.wait_for(g, std::chrono::milliseconds(50));
+            for (auto *r : rings)
+                write(r);
+            fflush(file);
+        }
+    }
+
+    void write(TraceRing *r)
+    {
+        auto pid = (int)TNC_TRACE_GETPID();
+        if (!r->named)
+        {
+            r->named = true;
+            fprintf(file,
+                    "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                    "\"args\":{\"name\":\"%s\"}},\n",
+                    pid, r->track, r->label.c_str());
+        }
+
+        r->drain([this, r, pid](const TraceRecord &e) {
+            auto ts = e.start / 1000.0;
+            switch (e.kind)
+            {
+            case TraceRecord::complete:
+                fprintf(file,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,"
+                        "\"dur\":%.3f},\n",
+                        e.name, pid, r->track, ts, e.duration / 1000.0);
+                break;
+            case TraceRecord::instant:
+                fprintf(file,
+                        "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,"
+                        "\"ts\":%.3f,\"args\":{\"value\":%lld}},\n",
+                        e.name, pid, r->track, ts, (long long)e.value);
+                break;
+            case TraceRecord::counter:
+                fprintf(file,
+                        "{\"name\":\"%s %u\",\"ph\":\"C\",\"pid\":%d,\"ts\":%.3f,"
+                        "\"args\":{\"value\":%lld}},\n",
+                        e.name, r->track, pid, ts, (long long)e.value);
+                break;
+            }
+        });
+
+        auto d = r->dropped.exchange(0, std::memory_order_relaxed);
+        if (d)
+            fprintf(file,
+                    "{\"name\":\"dropped records\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,"
+                    "\"tid\":%u,\"ts\":%.3f,\"args\":{\"value\":%u}},\n",
+                    pid, r->track, now() / 1000.0, d);
+    }
+
+    FILE *file{nullptr};
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread drainer;
+    std::vector<TraceRing *> rings;
+    uint32_t nextTrack{0};
+    bool stopping{false};
+};
+
+struct TraceInstance
+{
+    std::unique_ptr<TraceRing> process, main;
+
+    explicit TraceInstance(const char *plugin)
+    {
+        auto &s = TraceSession::get();
+        if (!s.enabled())
+            return;
+
+        static std::atomic<int> instances{0};
+        auto prefix = std::string(plugin) + " " + std::to_string(++instances);
+        process = std::make_unique<TraceRing>();
+        process->label = prefix + " processing";
+        s.add(process.get());
+        main = std::make_unique<TraceRing>();
+        main->label = prefix + " main";
+        s.add(main.get());
+    }
+
+    ~TraceInstance()
+    {
+        auto &s = TraceSession::get();
+        if (process)
+            s.remove(process.get());
+        if (main)
+            s.remove(main.get());
+    }
+};
+
+struct TraceScope
+{
+    TraceRing *ring;
+    const char *name;
+    uint64_t start{0};
+
+    TraceScope(const std::unique_ptr<TraceRing> &r, const char *n) : ring(r.get()), name(n)
+    {
+        if (ring)
+            start = TraceSession::get().now();
+    }
+    ~TraceScope()
+    {
+        if (ring)
+            ring->push({name, start, TraceSession::get().now() - start, 0,
+                        TraceRecord::complete});
+    }
+};
+
+inline void traceMark(const std::unique_ptr<TraceRing> &r, const char *name, int64_t value,
+                      TraceRecord::Kind kind)
+{
+    if (r)
+        r->push({name, TraceSession::get().now(), 0, value, kind});
+}
+
+#define TNC_TRACE_CONCAT_(a, b) a##b
+#define TNC_TRACE_CONCAT(a, b) TNC_TRACE_CONCAT_(a, b)
+
+#define TNC_TRACE_INSTANCE(member, plugin) TraceInstance member{plugin}
+#define TNC_TRACE_SCOPE(ring, name)                                                              \
+    TraceScope TNC_TRACE_CONCAT(tncTraceScope, __LINE__)(ring, name)
+#define TNC_TRACE_INSTANT(ring, name, value) traceMark(ring, name, value, TraceRecord::instant)
+#define TNC_TRACE_COUNTER(ring, name, value) traceMark(ring, name, value, TraceRecord::counter)
+
+#else
+
+#define TNC_TRACE_INSTANCE(member, plugin)
+#define TNC_TRACE_SCOPE(ring, name)
+#define TNC_TRACE_INSTANT(ring, name, value)
+#define TNC_TRACE_COUNTER(ring, name, value)
+
+#endif
+
+#endif // TUNING_NOTE_CLAPS_TRACE_H
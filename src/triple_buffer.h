@@ -0,0 +1,49 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_TRIPLE_BUFFER_H
+#define TUNING_NOTE_CLAPS_TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+
+/*
+ * TripleBuffer hands a value from one writer thread to one reader thread with no locks and
+ * no allocation. The writer fills writeBuffer() and calls publish(); the reader calls
+ * consume() when it is ready to take the newest published value, and read() stays stable
+ * until the next consume(). Neither side ever waits for the other.
+ */
+template <typename T> struct TripleBuffer
+{
+    static constexpr int fresh = 4;
+
+    std::array<T, 3> buffers;
+
+    T &writeBuffer() { return buffers[back]; }
+    void publish() { back = middle.exchange(back | fresh) & 3; }
+
+    bool consume()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & fresh))
+            return false;
+        front = middle.exchange(front) & 3;
+        return true;
+    }
+    const T &read() const { return buffers[front]; }
+
+  private:
+    int front{0}, back{1};
+    std::atomic<int> middle{2};
+};
+
+#endif // TUNING_NOTE_CLAPS_TRIPLE_BUFFER_H
@@ -0,0 +1,126 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_TUNING_BANK_H
+#define TUNING_NOTE_CLAPS_TUNING_BANK_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "mapped_file.h"
+
+/*
+ * A tuning bank is a file of precomputed retuning tables, written by tuning-bank-compiler
+ * and mapped read only, so switching entries costs a pointer swap. Everything is little
+ * endian and 8 byte aligned:
+ *
+ *   BankHeader
+ *   BankEntry[count]
+ *   double tables, each 128 values or, for per channel entries, 16 x 128 values
+ *
+ * Each value is the retuning of that key in semitones from 12-TET.
+ */
+namespace tuningbank
+{
+static constexpr char magic[4] = {'T', 'N', 'C', 'B'};
+static constexpr uint32_t version = 1;
+
+struct BankHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct BankEntry
+{
+    char name[64];
+    uint32_t channels; // 1, or 16 for a table per MIDI channel
+    uint32_t reserved;
+    uint64_t offset; // of the first double, from the start of the file
+};
+} // namespace tuningbank
+
+struct TuningBank
+{
+    static std::unique_ptr<TuningBank> open(const std::string &path)
+    {
+        auto res = std::unique_ptr<TuningBank>(new TuningBank());
+        if (!res->file.map(path) || !res->validate())
+            return nullptr;
+
+        // Called on the main thread; process() may switch to any table on any block
+        res->file.prefault();
+        return res;
+    }
+
+    uint32_t count() const { return header()->count; }
+    const char *name(uint32_t i) const { return entry(i)->name; }
+    uint32_t channels(uint32_t i) const { return entry(i)->channels; }
+
+    // Row of 128 retunings for a channel; single table entries give the same row for all
+    const double *table(uint32_t i, int channel = 0) const
+    {
+        auto e = entry(i);
+        auto t = reinterpret_cast<const double *>(file.data + e->offset);
+        return e->channels == 16 ? t + channel * 128 : t;
+    }
+
+  private:
+    TuningBank() = default;
+
+    MappedFile file;
+
+    const tuningbank::BankHeader *header() const
+    {
+        return reinterpret_cast<const tuningbank::BankHeader *>(file.data);
+    }
+    const tuningbank::BankEntry *entry(uint32_t i) const
+    {
+        return reinterpret_cast<const tuningbank::BankEntry *>(
+                   file.data + sizeof(tuningbank::BankHeader)) +
+               i;
+    }
+
+    bool validate() const
+    {
+        using namespace tuningbank;
+        auto size = file.size;
+        if (size < sizeof(BankHeader) || memcmp(header()->magic, magic, 4) != 0 ||
+            header()->version != version)
+            return false;
+
+        auto n = (uint64_t)header()->count;
+        if (sizeof(BankHeader) + n * sizeof(BankEntry) > size)
+            return false;
+
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            auto e = entry(i);
+            if (e->channels != 1 && e->channels != 16)
+                return false;
+            // Written so that no sum can wrap, whatever offset the file claims
+            if (e->offset % 8 != 0 || e->offset > size ||
+                size - e->offset < e->channels * 128 * sizeof(double))
+                return false;
+            if (memchr(e->name, 0, sizeof(e->name)) == nullptr)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_TUNING_BANK_H
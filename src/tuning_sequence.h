@@ -0,0 +1,178 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_TUNING_SEQUENCE_H
+#define TUNING_NOTE_CLAPS_TUNING_SEQUENCE_H
+
+#include <clap/events.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * TuningSequence is a short loop of tuning steps, each lasting some number of beats, laid
+ * along the host beat timeline. Once per block schedule() works out at which sample offsets
+ * the step changes, from the block start position, tempo and loop points, so it follows
+ * tempo changes and transport jumps without accumulating anything between blocks. The
+ * plugin owns the precomputed table for each step and swaps to it as next() hands back
+ * each change.
+ */
+struct TuningSequence
+{
+    static constexpr int maxSteps = 4;
+    static constexpr int maxChangesPerBlock = 64;
+
+    struct Step
+    {
+        double length{4}; // beats; 0 skips the step
+        int span{2}, divisions{19}, center{69};
+        double frequency{440};
+    };
+    std::array<Step, maxSteps> steps;
+    bool active{false};
+
+    struct Change
+    {
+        uint32_t time;
+        int step; // -1 means no step, so use the plugin's base tuning
+    };
+    std::array<Change, maxChangesPerBlock> changes;
+    int changeCount{0}, changeRead{0};
+    int scheduledStep{-1}; // the step in force once this block's changes are applied
+
+    double length() const
+    {
+        double res = 0;
+        for (const auto &s : steps)
+            res += std::max(s.length, 0.0);
+        return res;
+    }
+
+    void schedule(const clap_event_transport *tr, uint32_t frames, double sampleRate)
+    {
+        changeCount = 0;
+        changeRead = 0;
+
+        auto total = length();
+        if (!active || total <= 0 || !tr || !(tr->flags & CLAP_TRANSPORT_HAS_BEATS_TIMELINE))
+        {
+            push(0, -1);
+            return;
+        }
+
+        double beatsPerSample = 0;
+        if ((tr->flags & CLAP_TRANSPORT_IS_PLAYING) && (tr->flags & CLAP_TRANSPORT_HAS_TEMPO) &&
+            sampleRate > 0)
+            beatsPerSample = tr->tempo / (60.0 * sampleRate);
+
+        auto loopStart = (double)tr->loop_start_beats / CLAP_BEATTIME_FACTOR;
+        auto loopEnd = (double)tr->loop_end_beats / CLAP_BEATTIME_FACTOR;
+        auto looping = (tr->flags & CLAP_TRANSPORT_IS_LOOP_ACTIVE) &&
+                       loopEnd - loopStart > beatsPerSample;
+
+        // A segment runs from a block start or loop wrap; boundaries are measured from its
+        // start so rounding never builds up within the block
+        uint32_t segStart = 0;
+        double segBeat = (double)tr->song_pos_beats / CLAP_BEATTIME_FACTOR;
+        while (true)
+        {
+            int step;
+            double stepEnd;
+            stepAt(segBeat, total, step, stepEnd);
+            push(segStart, step);
+
+            if (beatsPerSample <= 0)
+                return;
+
+            auto wrapBeat = (looping && segBeat < loopEnd) ? loopEnd : HUGE_VAL;
+            while (true)
+            {
+                auto boundary = std::min(stepEnd, wrapBeat);
+                // The first sample at or past the boundary, allowing for the host position being
+                // fixed point
+                auto offset = std::ceil((boundary - segBeat) / beatsPerSample - 1e-3);
+                if (offset >= frames - segStart || changeCount == maxChangesPerBlock)
+                    return;
+
+                auto at = segStart + (uint32_t)std::max(offset, 0.0);
+                if (boundary == wrapBeat)
+                {
+                    segBeat = loopStart + (segBeat + (at - segStart) * beatsPerSample - loopEnd);
+                    segStart = at;
+                    break;
+                }
+
+                step = nextStep(step);
+                stepEnd += steps[step].length;
+                push(at, step);
+            }
+        }
+    }
+
+    // Pops the next change at or before upTo, if there is one
+    bool next(uint32_t upTo, uint32_t &at, int &step)
+    {
+        if (changeRead >= changeCount || changes[changeRead].time > upTo)
+            return false;
+
+        at = changes[changeRead].time;
+        step = changes[changeRead].step;
+        changeRead++;
+        return true;
+    }
+
+    void push(uint32_t time, int step)
+    {
+        if (step == scheduledStep || changeCount == maxChangesPerBlock)
+            return;
+
+        changes[changeCount++] = {time, step};
+        scheduledStep = step;
+    }
+
+    void stepAt(double beat, double total, int &step, double &stepEnd) const
+    {
+        auto phase = std::fmod(beat, total);
+        if (phase < 0)
+            phase += total;
+        auto cycleStart = beat - phase;
+
+        double cum = 0;
+        step = -1;
+        for (int i = 0; i < maxSteps; ++i)
+        {
+            if (steps[i].length <= 0)
+                continue;
+            step = i;
+            cum += steps[i].length;
+            if (phase < cum)
+                break;
+        }
+        stepEnd = cycleStart + cum;
+    }
+
+    int nextStep(int step) const
+    {
+        for (int i = 1; i <= maxSteps; ++i)
+        {
+            auto s = (step + i) % maxSteps;
+            if (steps[s].length > 0)
+                return s;
+        }
+        return step;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_TUNING_SEQUENCE_H
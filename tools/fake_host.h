@@ -0,0 +1,146 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+#ifndef TUNING_NOTE_CLAPS_FAKE_HOST_H
+#define TUNING_NOTE_CLAPS_FAKE_HOST_H
+
+#include <clap/clap.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Just enough of a CLAP host to drive our plugins from the command line tools. Each
+ * FakeHost owns one plugin instance; callback requests are noted and serviced when the
+ * tool calls serviceMainThread() from its main thread.
+ */
+extern "C" const clap_plugin_entry clap_entry;
+
+inline const clap_plugin_factory *pluginFactory()
+{
+    static bool inited = clap_entry.init("");
+    if (!inited)
+        return nullptr;
+    return static_cast<const clap_plugin_factory *>(
+        clap_entry.get_factory(CLAP_PLUGIN_FACTORY_ID));
+}
+
+struct FakeHost
+{
+    clap_host host;
+    const clap_plugin *plugin{nullptr};
+    std::atomic<bool> callbackRequested{false};
+
+    FakeHost()
+    {
+        host.clap_version = CLAP_VERSION;
+        host.host_data = this;
+        host.name = "tuning-note-claps tools";
+        host.vendor = "Surge Synth Team";
+        host.url = "https://github.com/surge-synthesizer/tuning-note-claps";
+        host.version = "1";
+        host.get_extension = [](const clap_host *, const char *) -> const void * {
+            return nullptr;
+        };
+        host.request_restart = [](const clap_host *) {};
+        host.request_process = [](const clap_host *) {};
+        host.request_callback = [](const clap_host *h) {
+            static_cast<FakeHost *>(h->host_data)->callbackRequested = true;
+        };
+    }
+    FakeHost(const FakeHost &) = delete;
+    FakeHost &operator=(const FakeHost &) = delete;
+
+    ~FakeHost()
+    {
+        if (plugin)
+            plugin->destroy(plugin);
+    }
+
+    bool create(const char *pluginId)
+    {
+        auto f = pluginFactory();
+        if (!f)
+            return false;
+        plugin = f->create_plugin(f, &host, pluginId);
+        return plugin && plugin->init(plugin);
+    }
+
+    template <typename T> const T *extension(const char *id) const
+    {
+        return static_cast<const T *>(plugin->get_extension(plugin, id));
+    }
+
+    void serviceMainThread()
+    {
+        if (callbackRequested.exchange(false))
+            plugin->on_main_thread(plugin);
+    }
+};
+
+/*
+ * A fixed capacity, time ordered list of input events, and an output list which keeps
+ * copies of what the plugin pushes. Neither allocates once constructed.
+ */
+union AnyEvent
+{
+    clap_event_header header;
+    clap_event_note note;
+    clap_event_note_expression expression;
+    clap_event_param_value param;
+    clap_event_midi midi;
+};
+
+template <size_t N> struct EventList
+{
+    std::array<AnyEvent, N> events;
+    uint32_t count{0}, dropped{0};
+    clap_input_events in;
+    clap_output_events out;
+
+    EventList()
+    {
+        in.ctx = this;
+        in.size = [](const clap_input_events *l) {
+            return static_cast<const EventList *>(l->ctx)->count;
+        };
+        in.get = [](const clap_input_events *l, uint32_t i) -> const clap_event_header * {
+            return &static_cast<const EventList *>(l->ctx)->events[i].header;
+        };
+        out.ctx = this;
+        out.try_push = [](const clap_output_events *l, const clap_event_header *e) {
+            return static_cast<EventList *>(l->ctx)->push(e);
+        };
+    }
+
+    void clear()
+    {
+        count = 0;
+        dropped = 0;
+    }
+
+    bool push(const clap_event_header *e)
+    {
+        if (count == N || e->size > sizeof(AnyEvent))
+        {
+            dropped++;
+            return false;
+        }
+        memcpy(&events[count++], e, e->size);
+        return true;
+    }
+};
+
+#endif // TUNING_NOTE_CLAPS_FAKE_HOST_H
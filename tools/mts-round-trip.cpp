@@ -0,0 +1,247 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+/*
+ * mts-round-trip makes an EDNMToNoteExpression instance the MTS-ESP master and checks that
+ * an MTSToNoteExpression instance, as its client, hears the same tuning. Both get a note on
+ * every key of every channel and the tuning expression each sends back has to agree. This is
+ * done for a single EDN-M and again with per channel tuning, where each channel of the
+ * client has to follow that channel of the master.
+ *
+ * MTS-ESP has to be installed and no other master may be running; otherwise there is
+ * nothing to check and the tool says so.
+ *
+ *   mts-round-trip
+ */
+
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "fake_host.h"
+#include "libMTSMaster.h"
+#include "rt_checks.h"
+
+static constexpr double sampleRate = 48000;
+static constexpr uint32_t blockSize = 256;
+
+// MTSToNoteExpression reads the retuning back as a float
+static constexpr double tolerance = 1e-4;
+
+struct Player
+{
+    FakeHost host;
+    const clap_plugin_params *params{nullptr};
+    EventList<512> in, out;
+    clap_process process;
+
+    bool setUp(const char *id)
+    {
+        if (!host.create(id))
+            return false;
+        params = host.extension<clap_plugin_params>(CLAP_EXT_PARAMS);
+
+        memset(&process, 0, sizeof(process));
+        process.frames_count = blockSize;
+        process.in_events = &in.in;
+        process.out_events = &out.out;
+
+        return params && host.plugin->activate(host.plugin, sampleRate, blockSize, blockSize) &&
+               host.plugin->start_processing(host.plugin);
+    }
+
+    bool setParam(const char *name, double value)
+    {
+        for (uint32_t i = 0; i < params->count(host.plugin); ++i)
+        {
+            clap_param_info info;
+            if (!params->get_info(host.plugin, i, &info) || strcmp(info.name, name) != 0)
+                continue;
+
+            clap_event_param_value p;
+            p.header.size = sizeof(p);
+            p.header.time = 0;
+            p.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+            p.header.type = CLAP_EVENT_PARAM_VALUE;
+            p.header.flags = 0;
+            p.param_id = info.id;
+            p.cookie = nullptr;
+            p.note_id = -1;
+            p.port_index = -1;
+            p.channel = -1;
+            p.key = -1;
+            p.value = value;
+            return in.push(&p.header);
+        }
+        fprintf(stderr, "No parameter named %s\n", name);
+        return false;
+    }
+
+    void note(uint16_t type, int16_t channel, int16_t key)
+    {
+        clap_event_note n;
+        n.header.size = sizeof(n);
+        n.header.time = 0;
+        n.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        n.header.type = type;
+        n.header.flags = 0;
+        n.note_id = -1;
+        n.port_index = 0;
+        n.channel = channel;
+        n.key = key;
+        n.velocity = 0.8;
+        in.push(&n.header);
+    }
+
+    // One block, then whatever the plugin asked the main thread to do
+    bool run()
+    {
+        out.clear();
+        auto status = host.plugin->process(host.plugin, &process);
+        in.clear();
+        host.serviceMainThread();
+        return status != CLAP_PROCESS_ERROR;
+    }
+
+    // The retuning the plugin sends with a note on for each key of the channel
+    bool probe(int16_t channel, std::array<double, 128> &retune)
+    {
+        for (int16_t k = 0; k < 128; ++k)
+            note(CLAP_EVENT_NOTE_ON, channel, k);
+        if (!run())
+            return false;
+
+        std::array<bool, 128> seen{};
+        for (uint32_t i = 0; i < out.count; ++i)
+        {
+            const auto &e = out.events[i].expression;
+            if (e.header.type != CLAP_EVENT_NOTE_EXPRESSION ||
+                e.expression_id != CLAP_NOTE_EXPRESSION_TUNING || e.channel != channel ||
+                e.key < 0 || e.key >= 128)
+                continue;
+            retune[e.key] = e.value;
+            seen[e.key] = true;
+        }
+
+        for (int16_t k = 0; k < 128; ++k)
+            note(CLAP_EVENT_NOTE_OFF, channel, k);
+        if (!run())
+            return false;
+
+        for (auto s : seen)
+            if (!s)
+                return false;
+        return true;
+    }
+};
+
+struct Case
+{
+    const char *name;
+    std::vector<std::pair<const char *, double>> params;
+};
+
+int main()
+{
+    if (!pluginFactory())
+    {
+        fprintf(stderr, "Could not get the plugin factory\n");
+        return 1;
+    }
+    if (!MTS_CanRegisterMaster())
+    {
+        printf("MTS-ESP is not installed or another master is running; nothing to check\n");
+        return 0;
+    }
+
+    Player master, client;
+    if (!master.setUp("org.surge-synth-team.EDNMToNoteExpression") ||
+        !client.setUp("org.surge-synth-team.MTSToNoteExpression"))
+    {
+        fprintf(stderr, "Could not start the plugins\n");
+        return 1;
+    }
+
+    // Each case builds on the settings of the one before
+    std::vector<Case> cases = {
+        {"13 steps of 3:1 from middle C",
+         {{"Publish As MTS-ESP Master", 1},
+          {"Even Division Of", 3},
+          {"Into Steps", 13},
+          {"Tuning Center Key", 60},
+          {"Tuning Center Frequency", 261.6256}}},
+        {"per channel tuning",
+         {{"Per Channel Tuning", 1},
+          {"Channel 2 Into Steps", 31},
+          {"Channel 3 Even Division Of", 3},
+          {"Channel 3 Into Steps", 13},
+          {"Channel 16 Tuning Center Frequency", 432}}},
+    };
+
+    int res = 0;
+    for (const auto &c : cases)
+    {
+        for (const auto &[name, value] : c.params)
+            if (!master.setParam(name, value))
+                return 1;
+
+        // Tables are built on the main thread and published from the block after
+        for (int i = 0; i < 4; ++i)
+            if (!master.run() || !client.run())
+                return 1;
+
+        int mismatched = 0;
+        for (int16_t ch = 0; ch < 16; ++ch)
+        {
+            std::array<double, 128> want, got;
+            if (!master.probe(ch, want) || !client.probe(ch, got))
+            {
+                fprintf(stderr, "%s: no tuning expression for some key on channel %d\n",
+                        c.name, ch + 1);
+                return 1;
+            }
+
+            for (int k = 0; k < 128; ++k)
+            {
+                if (std::fabs(want[k] - got[k]) <= tolerance)
+                    continue;
+                if (mismatched++ == 0)
+                    printf("%s: channel %d key %d is %.6f semitones on the master but %.6f on "
+                           "the client\n",
+                           c.name, ch + 1, k, want[k], got[k]);
+            }
+        }
+
+        if (mismatched > 0)
+        {
+            printf("%s: %d of %d keys differ\n", c.name, mismatched, 16 * 128);
+            res = 1;
+        }
+        else
+        {
+            printf("%s: all %d keys match\n", c.name, 16 * 128);
+        }
+    }
+
+#if TUNING_NOTE_CLAPS_RT_CHECKS
+    if (rtchecks::violations() > 0)
+    {
+        fprintf(stderr, "%llu realtime violations\n", (unsigned long long)rtchecks::violations());
+        return 2;
+    }
+#endif
+    return res;
+}
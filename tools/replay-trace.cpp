@@ -0,0 +1,513 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+/*
+ * replay-trace plays sessions captured with -DTUNING_NOTE_CLAPS_CAPTURE=ON (see capture.h)
+ * back through our plugin factory as fast as it can. The trace is mapped and its input events
+ * are handed to the plugin where they lie. Every block's output is checked against what the
+ * plugin produced in the session, and process() timing is reported for each trace.
+ *
+ * Only what the capture holds is replayed. Key layouts, tuning banks and the MTS-ESP master's
+ * tuning come from outside it, so a trace reproduces exactly only where those are the same.
+ *
+ *   replay-trace [--repeat N] [--no-compare] trace.tnccap ...
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "fake_host.h"
+#include "mapped_file.h"
+#include "rt_checks.h"
+
+using replay_clock = std::chrono::steady_clock;
+
+// Input events for one block, pointing into the mapped trace
+struct InputList
+{
+    std::vector<const clap_event_header *> events;
+    clap_input_events in;
+
+    InputList()
+    {
+        events.reserve(4096);
+        in.ctx = this;
+        in.size = [](const clap_input_events *l) {
+            return (uint32_t) static_cast<const InputList *>(l->ctx)->events.size();
+        };
+        in.get = [](const clap_input_events *l, uint32_t i) {
+            return static_cast<const InputList *>(l->ctx)->events[i];
+        };
+    }
+};
+
+struct MemoryStream
+{
+    const uint8_t *data;
+    uint64_t size, pos{0};
+    clap_istream stream;
+
+    MemoryStream(const uint8_t *d, uint64_t s) : data(d), size(s)
+    {
+        stream.ctx = this;
+        stream.read = [](const clap_istream *s, void *buffer, uint64_t n) -> int64_t {
+            auto self = static_cast<MemoryStream *>(s->ctx);
+            n = std::min(n, self->size - self->pos);
+            memcpy(buffer, self->data + self->pos, n);
+            self->pos += n;
+            return (int64_t)n;
+        };
+    }
+};
+
+struct Result
+{
+    std::string pluginId;
+    double sampleRate{0};
+    uint64_t blocks{0}, flushes{0}, frames{0};
+    uint64_t mismatched{0}, firstMismatch{0};
+    uint64_t dropped{0}, skippedInputs{0};
+    bool cutShort{false};
+    std::vector<uint32_t> latencies; // of each process() call, in ns
+    uint64_t processNs{0};
+};
+
+static bool sameEvent(const clap_event_header *a, const clap_event_header *b)
+{
+    if (a->type != b->type || a->space_id != b->space_id || a->time != b->time ||
+        a->size != b->size)
+        return false;
+
+    // Values get a little slack so a trace from one build replays on another
+    auto close = [](double x, double y) { return std::fabs(x - y) <= 1e-9; };
+    if (a->space_id == CLAP_CORE_EVENT_SPACE_ID)
+    {
+        switch (a->type)
+        {
+        case CLAP_EVENT_NOTE_EXPRESSION:
+        {
+            auto x = reinterpret_cast<const clap_event_note_expression *>(a);
+            auto y = reinterpret_cast<const clap_event_note_expression *>(b);
+            return x->expression_id == y->expression_id && x->note_id == y->note_id &&
+                   x->port_index == y->port_index && x->channel == y->channel &&
+                   x->key == y->key && close(x->value, y->value);
+        }
+        case CLAP_EVENT_PARAM_VALUE:
+        {
+            auto x = reinterpret_cast<const clap_event_param_value *>(a);
+            auto y = reinterpret_cast<const clap_event_param_value *>(b);
+            return x->param_id == y->param_id && x->note_id == y->note_id &&
+                   x->port_index == y->port_index && x->channel == y->channel &&
+                   x->key == y->key && close(x->value, y->value);
+        }
+        case CLAP_EVENT_NOTE_ON:
+        case CLAP_EVENT_NOTE_OFF:
+        case CLAP_EVENT_NOTE_CHOKE:
+        case CLAP_EVENT_NOTE_END:
+        {
+            auto x = reinterpret_cast<const clap_event_note *>(a);
+            auto y = reinterpret_cast<const clap_event_note *>(b);
+            return x->note_id == y->note_id && x->port_index == y->port_index &&
+                   x->channel == y->channel && x->key == y->key &&
+                   close(x->velocity, y->velocity);
+        }
+        case CLAP_EVENT_MIDI:
+        {
+            auto x = reinterpret_cast<const clap_event_midi *>(a);
+            auto y = reinterpret_cast<const clap_event_midi *>(b);
+            return x->port_index == y->port_index && memcmp(x->data, y->data, 3) == 0;
+        }
+        }
+    }
+    return memcmp(a, b, a->size) == 0;
+}
+
+static std::string describe(const clap_event_header *e)
+{
+    char buf[160];
+    if (e->space_id == CLAP_CORE_EVENT_SPACE_ID && e->type == CLAP_EVENT_NOTE_EXPRESSION)
+    {
+        auto x = reinterpret_cast<const clap_event_note_expression *>(e);
+        snprintf(buf, sizeof(buf), "expression %d at %u on %d/%d/%d = %.9f", x->expression_id,
+                 e->time, x->port_index, x->channel, x->key, x->value);
+    }
+    else if (e->space_id == CLAP_CORE_EVENT_SPACE_ID && e->type == CLAP_EVENT_PARAM_VALUE)
+    {
+        auto x = reinterpret_cast<const clap_event_param_value *>(e);
+        snprintf(buf, sizeof(buf), "param %u at %u = %.9f", x->param_id, e->time, x->value);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "event type %u space %u at %u", e->type, e->space_id,
+                 e->time);
+    }
+    return buf;
+}
+
+// Compares what the plugin pushed with the recorded events at expected
+template <size_t N>
+static void compareOutput(const EventList<N> &out, const uint8_t *expected, uint32_t count,
+                          uint64_t block, Result &r)
+{
+    std::string first;
+    if (out.count + out.dropped != count)
+        first = "expected " + std::to_string(count) + " events, got " +
+                std::to_string(out.count + out.dropped);
+
+    for (uint32_t i = 0; i < std::min(out.count, count) && first.empty(); ++i)
+    {
+        auto e = reinterpret_cast<const clap_event_header *>(expected);
+        if (!sameEvent(&out.events[i].header, e))
+            first = "event " + std::to_string(i) + ": expected " + describe(e) + ", got " +
+                    describe(&out.events[i].header);
+        expected += capture::padded(e->size);
+    }
+    if (first.empty())
+        return;
+
+    if (r.mismatched == 0)
+    {
+        r.firstMismatch = block;
+        fprintf(stderr, "  block %llu: %s\n", (unsigned long long)block, first.c_str());
+    }
+    r.mismatched++;
+}
+
+static bool loadState(const clap_plugin *plugin, const clap_plugin_state *state,
+                      const uint8_t *data, uint64_t size)
+{
+    if (!state || size == 0)
+        return true;
+    MemoryStream ms(data, size);
+    return state->load(plugin, &ms.stream);
+}
+
+static bool replay(const MappedFile &f, const char *path, bool compare, Result &r)
+{
+    using namespace capture;
+    auto fh = reinterpret_cast<const FileHeader *>(f.data);
+    if (f.size < sizeof(FileHeader) || memcmp(fh->magic, magic, sizeof(magic)) != 0 ||
+        fh->version != version)
+    {
+        fprintf(stderr, "%s is not a capture this build can read\n", path);
+        return false;
+    }
+
+    FakeHost host;
+    const clap_plugin_state *state{nullptr};
+    const clap_plugin_params *params{nullptr};
+    bool active{false}, comparing{compare};
+
+    // A state loaded while active takes effect in the block which applied it in the session
+    const uint8_t *pendingState{nullptr};
+    uint64_t pendingStateSize{0};
+
+    InputList in;
+    EventList<4096> out;
+
+    // The host can go away part way through writing the capture
+    auto intact = [&r](const uint8_t *from, const uint8_t *end, uint32_t events) {
+        for (uint32_t i = 0; i < events; ++i)
+        {
+            auto e = reinterpret_cast<const clap_event_header *>(from);
+            if (end - from < (ptrdiff_t)sizeof(clap_event_header) ||
+                capture::padded(e->size) > (size_t)(end - from))
+            {
+                r.cutShort = true;
+                return false;
+            }
+            from += capture::padded(e->size);
+        }
+        return true;
+    };
+
+    r.cutShort = false;
+    size_t pos = sizeof(FileHeader);
+    while (pos < f.size && !r.cutShort)
+    {
+        auto h = reinterpret_cast<const RecordHeader *>(f.data + pos);
+        auto body = f.data + pos + sizeof(RecordHeader);
+        if (f.size - pos < sizeof(RecordHeader) || h->size > f.size - pos - sizeof(RecordHeader))
+        {
+            r.cutShort = true;
+            break;
+        }
+        pos += sizeof(RecordHeader) + h->size;
+
+        if (h->type != rec_plugin && !host.plugin)
+        {
+            fprintf(stderr, "%s does not start with a plugin record\n", path);
+            return false;
+        }
+
+        switch (h->type)
+        {
+        case rec_plugin:
+        {
+            r.pluginId = std::string((const char *)body, strnlen((const char *)body, h->size));
+            if (host.plugin || !host.create(r.pluginId.c_str()))
+            {
+                fprintf(stderr, "%s: could not create %s\n", path, r.pluginId.c_str());
+                return false;
+            }
+            state = host.extension<clap_plugin_state>(CLAP_EXT_STATE);
+            params = host.extension<clap_plugin_params>(CLAP_EXT_PARAMS);
+        }
+        break;
+        case rec_activate:
+        {
+            auto a = reinterpret_cast<const ActivateRecord *>(body);
+            if (h->size < sizeof(ActivateRecord) ||
+                a->stateSize > h->size - sizeof(ActivateRecord))
+            {
+                r.cutShort = true;
+                break;
+            }
+            if (active)
+            {
+                host.plugin->stop_processing(host.plugin);
+                host.plugin->deactivate(host.plugin);
+            }
+            pendingState = nullptr;
+            if (!loadState(host.plugin, state, body + sizeof(ActivateRecord), a->stateSize))
+                fprintf(stderr, "%s: the plugin rejected the captured state\n", path);
+            r.sampleRate = a->sampleRate;
+            active = host.plugin->activate(host.plugin, a->sampleRate, a->minFrames,
+                                           a->maxFrames) &&
+                     host.plugin->start_processing(host.plugin);
+            if (!active)
+            {
+                fprintf(stderr, "%s: could not activate %s\n", path, r.pluginId.c_str());
+                return false;
+            }
+        }
+        break;
+        case rec_deactivate:
+        {
+            if (active)
+            {
+                host.plugin->stop_processing(host.plugin);
+                host.plugin->deactivate(host.plugin);
+            }
+            active = false;
+            pendingState = nullptr;
+        }
+        break;
+        case rec_state:
+        {
+            auto size = *reinterpret_cast<const uint64_t *>(body);
+            if (h->size < sizeof(uint64_t) || size > h->size - sizeof(uint64_t))
+            {
+                r.cutShort = true;
+                break;
+            }
+            pendingState = body + sizeof(uint64_t);
+            pendingStateSize = size;
+        }
+        break;
+        case rec_process:
+        case rec_flush:
+        {
+            auto b = reinterpret_cast<const BlockRecord *>(body);
+            auto end = body + h->size;
+            auto ep = body + sizeof(BlockRecord);
+            if (h->size < sizeof(BlockRecord) || !intact(ep, end, b->inCount + b->outCount))
+            {
+                r.cutShort = true;
+                break;
+            }
+
+            // After a gap the plugin's state has drifted from the session's
+            r.dropped += b->droppedBefore;
+            r.skippedInputs += b->skippedInputs;
+            if (b->droppedBefore > 0)
+                comparing = false;
+
+            if ((b->flags & load_applied) && pendingState)
+            {
+                loadState(host.plugin, state, pendingState, pendingStateSize);
+                pendingState = nullptr;
+            }
+
+            in.events.clear();
+            for (uint32_t i = 0; i < b->inCount; ++i)
+            {
+                auto e = reinterpret_cast<const clap_event_header *>(ep);
+                in.events.push_back(e);
+                ep += padded(e->size);
+            }
+            out.clear();
+
+            if (h->type == rec_process && active)
+            {
+                clap_process p;
+                memset(&p, 0, sizeof(p));
+                p.steady_time = b->steadyTime;
+                p.frames_count = b->frames;
+                p.transport = (b->flags & has_transport) ? &b->transport : nullptr;
+                p.in_events = &in.in;
+                p.out_events = &out.out;
+
+                auto start = replay_clock::now();
+                {
+                    TNC_REALTIME_SCOPE();
+                    host.plugin->process(host.plugin, &p);
+                }
+                auto ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              replay_clock::now() - start)
+                              .count();
+                r.latencies.push_back((uint32_t)std::min<uint64_t>(ns, UINT32_MAX));
+                r.processNs += ns;
+                r.blocks++;
+                r.frames += b->frames;
+            }
+            else if (h->type == rec_flush && params)
+            {
+                params->flush(host.plugin, &in.in, &out.out);
+                r.flushes++;
+            }
+
+            if (comparing && !(b->flags & output_truncated))
+                compareOutput(out, ep, b->outCount, h->block, r);
+
+            // Hosts service callbacks between blocks on their main thread
+            host.serviceMainThread();
+        }
+        break;
+        default:
+            break; // from a later version; its size lets us step over it
+        }
+    }
+
+    if (active)
+    {
+        host.plugin->stop_processing(host.plugin);
+        host.plugin->deactivate(host.plugin);
+    }
+    return true;
+}
+
+static double percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    auto i = (size_t)std::min<double>(sorted.size() - 1, std::ceil(p * sorted.size()) - 1);
+    return sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 1;
+    bool compare = true;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        auto a = std::string(argv[i]);
+        if (a == "--repeat" && i + 1 < argc)
+            repeat = std::max(1, std::atoi(argv[++i]));
+        else if (a == "--no-compare")
+            compare = false;
+        else if (a.rfind("--", 0) == 0)
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+        else
+            paths.push_back(a);
+    }
+    if (paths.empty())
+    {
+        fprintf(stderr, "Usage: replay-trace [--repeat N] [--no-compare] trace.tnccap ...\n");
+        return 1;
+    }
+
+    if (!pluginFactory())
+    {
+        fprintf(stderr, "Could not get the plugin factory\n");
+        return 1;
+    }
+
+    int res = 0;
+    for (const auto &path : paths)
+    {
+        MappedFile f;
+        if (!f.map(path))
+        {
+            fprintf(stderr, "Could not read %s\n", path.c_str());
+            res = 1;
+            continue;
+        }
+
+        Result r;
+        bool ok = true;
+        for (int i = 0; i < repeat && ok; ++i)
+            ok = replay(f, path.c_str(), compare, r);
+        if (!ok)
+        {
+            res = 1;
+            continue;
+        }
+
+        auto audio = r.sampleRate > 0 ? r.frames / r.sampleRate : 0;
+        printf("%s: %s\n", path.c_str(), r.pluginId.c_str());
+        printf("  %llu blocks and %llu flushes, %.1f s of audio at %.0f Hz, replayed %d time%s "
+               "in %.1f ms of process() (%.0fx realtime)\n",
+               (unsigned long long)r.blocks / repeat, (unsigned long long)r.flushes / repeat,
+               audio / repeat, r.sampleRate, repeat, repeat == 1 ? "" : "s", r.processNs / 1e6,
+               r.processNs > 0 ? audio / (r.processNs / 1e9) : 0);
+
+        auto sorted = r.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        printf("  process() us: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+               percentile(sorted, 0.5), percentile(sorted, 0.9), percentile(sorted, 0.99),
+               percentile(sorted, 0.999), sorted.empty() ? 0 : sorted.back() / 1000.0);
+
+        if (!compare)
+            printf("  output not compared\n");
+        else if (r.mismatched > 0)
+            printf("  output differs from the capture in %llu blocks, first at block %llu\n",
+                   (unsigned long long)r.mismatched, (unsigned long long)r.firstMismatch);
+        else
+            printf("  output matches the capture\n");
+
+        if (r.dropped > 0)
+            printf("  %llu blocks were lost in capture; output is only compared before the "
+                   "first loss\n",
+                   (unsigned long long)r.dropped / repeat);
+        if (r.skippedInputs > 0)
+            printf("  %llu input events such as SysEx were not captured\n",
+                   (unsigned long long)r.skippedInputs / repeat);
+        if (r.cutShort)
+            printf("  the capture ends part way through a record\n");
+
+        if (r.mismatched > 0)
+            res = 1;
+    }
+
+#if TUNING_NOTE_CLAPS_RT_CHECKS
+    if (rtchecks::violations() > 0)
+    {
+        fprintf(stderr, "%llu realtime violations\n", (unsigned long long)rtchecks::violations());
+        return 2;
+    }
+#endif
+    return res;
+}
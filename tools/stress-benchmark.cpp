@@ -0,0 +1,466 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+/*
+ * stress-benchmark creates N instances of every plugin in our factory and drives them the
+ * way a host's worker pool would: each audio cycle every instance processes one block, and
+ * the pool threads pull instances off a shared counter until the cycle is done. Instances
+ * get a steady stream of chords and MPE style tuning glides. Now and then they also get a
+ * MIDI program change or a move of a parameter which makes them build or pick another
+ * tuning. When MTS-ESP is installed, a local master keeps changing the tuning underneath
+ * them.
+ *
+ * The same cycles are run with 1, 2, 4 ... up to the requested number of threads, and for
+ * each we report throughput, per process() call latency percentiles, and how many cycles
+ * missed the block deadline.
+ *
+ *   stress-benchmark [--instances N] [--blocks B] [--block-size F] [--threads T]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fake_host.h"
+#include "libMTSMaster.h"
+#include "rt_checks.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr double sampleRate = 48000;
+
+// The release time, and the parameters which make a plugin build or pick another tuning
+static bool automates(const char *name)
+{
+    if (strncmp(name, "Post Note Release", 17) == 0)
+        return true;
+
+    // Sequence steps have the base EDN-M parameters behind a prefix
+    int n = 0;
+    if (sscanf(name, "Sequence Step %*d %n", &n) == 0 && n > 0)
+        name += n;
+    static const char *names[] = {"Even Division Of", "Into Steps", "Tuning Center Key",
+                                  "Tuning Center Frequency", "Tuning Sequence", "Bank Program"};
+    for (auto t : names)
+        if (strcmp(name, t) == 0)
+            return true;
+    return false;
+}
+
+struct Instance
+{
+    FakeHost host;
+    const clap_plugin_params *params{nullptr};
+
+    struct Automated
+    {
+        clap_id id;
+        double min, max;
+        bool stepped;
+    };
+    std::array<Automated, 32> automated;
+    int automatedCount{0};
+
+    EventList<256> in;
+    EventList<4096> out;
+    clap_event_transport transport;
+    clap_process process;
+
+    // The notes this instance is holding, by channel and key
+    struct Held
+    {
+        int16_t channel, key;
+    };
+    std::array<Held, 16> held;
+    int heldCount{0};
+    int nextChannel{0};
+    uint32_t rng;
+    double beat{0};
+
+    Instance(uint32_t seed) : rng(seed * 2654435761u + 1) {}
+
+    uint32_t rand()
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng;
+    }
+
+    bool setUp(const char *id, uint32_t blockSize)
+    {
+        if (!host.create(id))
+            return false;
+
+        params = host.extension<clap_plugin_params>(CLAP_EXT_PARAMS);
+        if (params)
+        {
+            for (uint32_t i = 0; i < params->count(host.plugin); ++i)
+            {
+                clap_param_info info;
+                if (params->get_info(host.plugin, i, &info) && automates(info.name) &&
+                    automatedCount < (int)automated.size())
+                    automated[automatedCount++] = {info.id, info.min_value, info.max_value,
+                                                   (info.flags & CLAP_PARAM_IS_STEPPED) != 0};
+            }
+        }
+
+        memset(&transport, 0, sizeof(transport));
+        transport.header.size = sizeof(transport);
+        transport.header.type = CLAP_EVENT_TRANSPORT;
+        transport.flags = CLAP_TRANSPORT_HAS_TEMPO | CLAP_TRANSPORT_HAS_BEATS_TIMELINE |
+                          CLAP_TRANSPORT_IS_PLAYING;
+        transport.tempo = 120;
+
+        memset(&process, 0, sizeof(process));
+        process.frames_count = blockSize;
+        process.transport = &transport;
+        process.in_events = &in.in;
+        process.out_events = &out.out;
+
+        return host.plugin->activate(host.plugin, sampleRate, blockSize, blockSize) &&
+               host.plugin->start_processing(host.plugin);
+    }
+
+    void note(uint16_t type, uint32_t time, int16_t channel, int16_t key)
+    {
+        clap_event_note n;
+        n.header.size = sizeof(n);
+        n.header.time = time;
+        n.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+        n.header.type = type;
+        n.header.flags = 0;
+        n.note_id = -1;
+        n.port_index = 0;
+        n.channel = channel;
+        n.key = key;
+        n.velocity = 0.8;
+        in.push(&n.header);
+    }
+
+    // A bit over one chord change a beat, with glides on held notes in between
+    void makeEvents()
+    {
+        in.clear();
+        auto frames = process.frames_count;
+        uint32_t time = 0;
+        while (true)
+        {
+            time += rand() % (frames / 2 + 1);
+            if (time >= frames)
+                break;
+
+            auto r = rand() % 100;
+            if (r < 20 && heldCount < (int)held.size())
+            {
+                auto k = (int16_t)(48 + rand() % 36);
+                auto c = (int16_t)(1 + nextChannel++ % 15); // MPE member channels
+                note(CLAP_EVENT_NOTE_ON, time, c, k);
+                held[heldCount++] = {c, k};
+            }
+            else if (r < 40 && heldCount > 0)
+            {
+                auto i = rand() % heldCount;
+                note(CLAP_EVENT_NOTE_OFF, time, held[i].channel, held[i].key);
+                held[i] = held[--heldCount];
+            }
+            else if (r < 98 && heldCount > 0)
+            {
+                auto &h = held[rand() % heldCount];
+                clap_event_note_expression e;
+                e.header.size = sizeof(e);
+                e.header.time = time;
+                e.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+                e.header.type = CLAP_EVENT_NOTE_EXPRESSION;
+                e.header.flags = 0;
+                e.expression_id = CLAP_NOTE_EXPRESSION_TUNING;
+                e.note_id = -1;
+                e.port_index = 0;
+                e.channel = h.channel;
+                e.key = h.key;
+                e.value = ((int)(rand() % 200) - 100) * 0.01;
+                in.push(&e.header);
+            }
+            else if (r == 98)
+            {
+                clap_event_midi m;
+                m.header.size = sizeof(m);
+                m.header.time = time;
+                m.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+                m.header.type = CLAP_EVENT_MIDI;
+                m.header.flags = 0;
+                m.port_index = 0;
+                m.data[0] = (uint8_t)(0xC0 | rand() % 16);
+                m.data[1] = (uint8_t)(rand() % 128);
+                m.data[2] = 0;
+                in.push(&m.header);
+            }
+            else if (automatedCount > 0)
+            {
+                const auto &a = automated[rand() % automatedCount];
+                auto v = a.min + (a.max - a.min) * (rand() % 1001) * 0.001;
+                clap_event_param_value p;
+                p.header.size = sizeof(p);
+                p.header.time = time;
+                p.header.space_id = CLAP_CORE_EVENT_SPACE_ID;
+                p.header.type = CLAP_EVENT_PARAM_VALUE;
+                p.header.flags = 0;
+                p.param_id = a.id;
+                p.cookie = nullptr;
+                p.note_id = -1;
+                p.port_index = -1;
+                p.channel = -1;
+                p.key = -1;
+                p.value = a.stepped ? std::round(v) : v;
+                in.push(&p.header);
+            }
+        }
+    }
+
+    uint64_t run()
+    {
+        makeEvents();
+        out.clear();
+        transport.song_pos_beats = (clap_beattime)std::llround(beat * CLAP_BEATTIME_FACTOR);
+
+        auto start = bench_clock::now();
+        host.plugin->process(host.plugin, &process);
+        auto end = bench_clock::now();
+
+        beat += process.frames_count * transport.tempo / (60.0 * sampleRate);
+        process.steady_time += process.frames_count;
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+};
+
+/*
+ * Workers spin between cycles the way host audio pools do, so waking them costs nothing.
+ * Each cycle they take instances from a shared counter until none are left.
+ */
+struct Pool
+{
+    std::vector<std::unique_ptr<Instance>> &instances;
+    std::vector<uint32_t> &latencies; // [instance * blocks + block], in ns
+    uint32_t blocks;
+
+    std::atomic<uint32_t> cycle{0};
+    std::atomic<uint32_t> nextJob{0}, finished{0};
+    std::atomic<bool> quit{false};
+    std::vector<std::thread> threads;
+    uint32_t block{0};
+
+    Pool(std::vector<std::unique_ptr<Instance>> &i, std::vector<uint32_t> &l, uint32_t b,
+         int threadCount)
+        : instances(i), latencies(l), blocks(b)
+    {
+        for (int t = 0; t < threadCount; ++t)
+            threads.emplace_back([this]() { work(); });
+    }
+
+    ~Pool()
+    {
+        quit = true;
+        for (auto &t : threads)
+            t.join();
+    }
+
+    void work()
+    {
+        uint32_t seen = 0;
+        while (true)
+        {
+            uint32_t c;
+            while ((c = cycle.load(std::memory_order_acquire)) == seen)
+            {
+                if (quit)
+                    return;
+                std::this_thread::yield();
+            }
+            seen = c;
+
+            {
+                TNC_REALTIME_SCOPE();
+                uint32_t j;
+                while ((j = nextJob.fetch_add(1)) < instances.size())
+                    latencies[j * blocks + block] = (uint32_t)std::min<uint64_t>(
+                        instances[j]->run(), UINT32_MAX);
+            }
+            finished.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    uint64_t runCycle(uint32_t b)
+    {
+        block = b;
+        nextJob = 0;
+        finished = 0;
+        auto start = bench_clock::now();
+        cycle.fetch_add(1, std::memory_order_release);
+        while (finished.load(std::memory_order_acquire) < threads.size())
+            std::this_thread::yield();
+        auto end = bench_clock::now();
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+};
+
+static double percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    auto i = (size_t)std::min<double>(sorted.size() - 1, std::ceil(p * sorted.size()) - 1);
+    return sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t perPlugin = 32, blocks = 2000, blockSize = 64;
+    int maxThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        auto a = std::string(argv[i]);
+        auto v = std::atoi(argv[i + 1]);
+        if (a == "--instances")
+            perPlugin = std::max(1, v);
+        else if (a == "--blocks")
+            blocks = std::max(1, v);
+        else if (a == "--block-size")
+            blockSize = std::max(1, v);
+        else if (a == "--threads")
+            maxThreads = std::max(1, v);
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    auto factory = pluginFactory();
+    if (!factory)
+    {
+        fprintf(stderr, "Could not get the plugin factory\n");
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Instance>> instances;
+    for (uint32_t p = 0; p < factory->get_plugin_count(factory); ++p)
+    {
+        auto desc = factory->get_plugin_descriptor(factory, p);
+        for (uint32_t i = 0; i < perPlugin; ++i)
+        {
+            auto inst = std::make_unique<Instance>((uint32_t)instances.size());
+            if (!inst->setUp(desc->id, blockSize))
+            {
+                fprintf(stderr, "Could not create and activate %s\n", desc->id);
+                return 1;
+            }
+            instances.push_back(std::move(inst));
+        }
+    }
+
+    // A local master for every MTSNE instance to follow, if MTS-ESP is installed
+    std::atomic<bool> stopMaster{false};
+    std::thread master;
+    auto haveMaster = MTS_CanRegisterMaster();
+    if (haveMaster)
+    {
+        MTS_RegisterMaster();
+        master = std::thread([&stopMaster]() {
+            int n = 0;
+            double freqs[128];
+            while (!stopMaster)
+            {
+                auto edo = 12 + (n % 20);
+                for (int k = 0; k < 128; ++k)
+                    freqs[k] = 440.0 * std::pow(2.0, (k - 69) / (double)edo);
+                MTS_SetNoteTunings(freqs);
+                if (n % 10 == 0)
+                    MTS_SetScaleName((std::to_string(edo) + " EDO").c_str());
+                n++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        });
+    }
+
+    auto deadline = blockSize / sampleRate * 1e9;
+    printf("%zu instances (%u of each plugin), %u blocks of %u frames, MTS-ESP master %s\n",
+           instances.size(), perPlugin, blocks, blockSize, haveMaster ? "running" : "unavailable");
+    printf("%8s %14s %9s %9s %9s %9s %9s %13s  %s\n", "threads", "blocks/s", "p50 us",
+           "p90 us", "p99 us", "p99.9 us", "max us", "late cycles", "scaling");
+
+    std::vector<uint32_t> latencies(instances.size() * blocks);
+    double singleThroughput = 0;
+    for (int threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        uint32_t late = 0;
+        uint64_t total = 0;
+        {
+            Pool pool(instances, latencies, blocks, threads);
+            for (uint32_t b = 0; b < blocks; ++b)
+            {
+                auto t = pool.runCycle(b);
+                total += t;
+                if (t > deadline)
+                    late++;
+
+                // Hosts service callbacks between cycles on their main thread
+                for (auto &i : instances)
+                    i->host.serviceMainThread();
+            }
+        }
+
+        auto sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        auto throughput = instances.size() * blocks / (total / 1e9);
+        if (threads == 1)
+            singleThroughput = throughput;
+
+        printf("%8d %14.0f %9.2f %9.2f %9.2f %9.2f %9.2f %5u (%4.1f%%)  x%.2f\n", threads,
+               throughput, percentile(sorted, 0.5), percentile(sorted, 0.9),
+               percentile(sorted, 0.99), percentile(sorted, 0.999), sorted.back() / 1000.0, late,
+               100.0 * late / blocks, throughput / singleThroughput);
+
+        if (threads == maxThreads)
+            break;
+    }
+
+    if (haveMaster)
+    {
+        stopMaster = true;
+        master.join();
+        MTS_DeregisterMaster();
+    }
+
+    for (auto &i : instances)
+    {
+        i->host.plugin->stop_processing(i->host.plugin);
+        i->host.plugin->deactivate(i->host.plugin);
+    }
+
+#if TUNING_NOTE_CLAPS_RT_CHECKS
+    if (rtchecks::violations() > 0)
+    {
+        fprintf(stderr, "%llu realtime violations\n", (unsigned long long)rtchecks::violations());
+        return 2;
+    }
+#endif
+    return 0;
+}
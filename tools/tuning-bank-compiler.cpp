@@ -0,0 +1,142 @@
+/*
+ * tuning-note-claps
+ * https://github.com/surge-synthesizer/tuning-note-claps
+ *
+ * Released under the MIT License, included in the file "LICENSE.md"
+ * Copyright 2022, Paul Walker and other contributors as listed in the github
+ * transaction log.
+ *
+ * tuning-note-claps provides a set of CLAP plugins which augment
+ * note expression streams with Note Expressions for microtonal features.
+ * It is free and open source software.
+ */
+
+/*
+ * tuning-bank-compiler writes a .tncbank file for EDNMToNoteExpression's "Tuning Bank"
+ * parameter. Each argument after the output path is one bank entry, in program order:
+ *
+ *   edo:SPAN:DIVISIONS:CENTER:FREQUENCY   an EDN-M like the plugin's own
+ *   scl:FILE.scl[:FILE.kbm]               a Scala scale with an optional mapping
+ *
+ * Joining up to 16 of these with '|' makes a per channel entry; the last one given covers
+ * the remaining channels.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Tunings.h"
+
+#include "tuning_bank.h"
+
+static std::vector<std::string> split(const std::string &s, char sep)
+{
+    std::vector<std::string> res;
+    std::istringstream iss(s);
+    std::string part;
+    while (std::getline(iss, part, sep))
+        res.push_back(part);
+    return res;
+}
+
+static Tunings::Tuning tuningFor(const std::string &spec, std::string &name)
+{
+    auto parts = split(spec, ':');
+    if (parts.size() == 5 && parts[0] == "edo")
+    {
+        auto span = std::stoi(parts[1]), divisions = std::stoi(parts[2]);
+        auto center = std::stoi(parts[3]);
+        auto frequency = std::stod(parts[4]);
+        name = parts[2] + "ED" + parts[1];
+        return Tunings::Tuning(Tunings::evenDivisionOfSpanByM(span, divisions),
+                               Tunings::tuneNoteTo(center, frequency));
+    }
+    if ((parts.size() == 2 || parts.size() == 3) && parts[0] == "scl")
+    {
+        auto scale = Tunings::readSCLFile(parts[1]);
+        name = scale.description.empty() ? parts[1] : scale.description;
+        if (parts.size() == 3)
+            return Tunings::Tuning(scale, Tunings::readKBMFile(parts[2]));
+        return Tunings::Tuning(scale);
+    }
+    throw Tunings::TuningError("Unknown entry '" + spec + "'");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " out.tncbank entry [entry ...]\n"
+                  << "  entry is edo:SPAN:DIVISIONS:CENTER:FREQUENCY or scl:FILE.scl[:FILE.kbm]\n"
+                  << "  join up to 16 entries with '|' for a table per channel" << std::endl;
+        return 1;
+    }
+
+    using namespace tuningbank;
+    std::vector<BankEntry> entries;
+    std::vector<double> tables;
+
+    try
+    {
+        for (int i = 2; i < argc; ++i)
+        {
+            auto specs = split(argv[i], '|');
+            if (specs.empty() || specs.size() > 16)
+                throw Tunings::TuningError("An entry needs between 1 and 16 tunings");
+
+            BankEntry e;
+            memset(&e, 0, sizeof(e));
+            e.channels = specs.size() == 1 ? 1 : 16;
+            e.offset = tables.size() * sizeof(double);
+
+            std::string name;
+            for (uint32_t c = 0; c < e.channels; ++c)
+            {
+                std::string chName;
+                auto t = tuningFor(specs[std::min<size_t>(c, specs.size() - 1)], chName);
+                if (c == 0)
+                    name = chName;
+                for (int k = 0; k < 128; ++k)
+                    tables.push_back(t.retuningFromEqualInSemitonesForMidiNote(k));
+            }
+            if (e.channels == 16)
+                name += " (per channel)";
+            strncpy(e.name, name.c_str(), sizeof(e.name) - 1);
+            entries.push_back(e);
+        }
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return 2;
+    }
+
+    BankHeader h;
+    memcpy(h.magic, magic, sizeof(h.magic));
+    h.version = version;
+    h.count = (uint32_t)entries.size();
+    h.reserved = 0;
+
+    // Table offsets so far are relative to the first table
+    auto tableStart = sizeof(BankHeader) + entries.size() * sizeof(BankEntry);
+    for (auto &e : entries)
+        e.offset += tableStart;
+
+    std::ofstream ofs(argv[1], std::ios::binary);
+    ofs.write((const char *)&h, sizeof(h));
+    ofs.write((const char *)entries.data(), entries.size() * sizeof(BankEntry));
+    ofs.write((const char *)tables.data(), tables.size() * sizeof(double));
+    if (!ofs)
+    {
+        std::cerr << "Error: could not write " << argv[1] << std::endl;
+        return 2;
+    }
+
+    std::cout << "Wrote " << entries.size() << " entries to " << argv[1] << std::endl;
+    return 0;
+}